@@ -0,0 +1,151 @@
+#!/usr/bin/perl -w
+
+##
+# Builds a disk image with one clean ext2 partition and checks that
+# myfsck -B finds nothing to fix in its backup superblocks and GDTs,
+# both right after mke2fs and after the primary superblock is updated
+# the way the kernel does it on mount, without touching the backups.
+##
+
+#### Package declarations ###########
+
+use strict;
+use warnings;
+use diagnostics;
+use Getopt::Long;
+use File::Compare;
+use File::Copy;
+
+########
+
+my $g_part_start = 2048;
+my $g_part_length = 65536;
+
+my $g_sector_size = 512;
+my $g_super_offset = 1024;
+
+my $g_myfsck_exec = "./myfsck";
+my $g_mke2fs_exec = "/sbin/mke2fs";
+
+my $g_tmp_dir;
+
+my $g_failures = 0;
+
+
+########
+
+sub print_usage {
+    print "./backup_test.pl --tmp_dir\n";
+    print "\ttmp_dir: Directory in which to place the image\n";
+}
+
+sub get_options {
+    GetOptions("tmp_dir=s"     => \$g_tmp_dir);
+
+    if (!defined $g_tmp_dir) {
+	print_usage();
+	exit(-1);
+    }
+}
+
+sub run {
+    my ($cmd) = @_;
+    if (system($cmd) != 0) {
+	print "Failed: $cmd\n";
+	exit(-1);
+    }
+}
+
+##
+# Writes bytes into the file at the given offset
+##
+sub write_bytes {
+    my ($file, $offset, $bytes) = @_;
+    open(my $fh, "+<", $file) or die "Cannot open $file: $!";
+    sysseek($fh, $offset, 0) or die "Cannot seek: $!";
+    syswrite($fh, $bytes) == length($bytes) or die "Cannot write: $!";
+    close($fh);
+}
+
+##
+# MBR: one ext2 partition with several block groups, so it has backups.
+# 128 byte inodes and no newer features, like the provided disk image.
+##
+sub make_image {
+    my ($image_file) = @_;
+    my $part_file = "$image_file.part";
+
+    open(my $fh, ">", $part_file) or die "Cannot create $part_file: $!";
+    truncate($fh, $g_part_length * $g_sector_size) or die "Cannot truncate: $!";
+    close($fh);
+    run("$g_mke2fs_exec -q -F -t ext2 -b 1024 -I 128 " .
+	"-O ^resize_inode,^dir_index,^ext_attr $part_file >/dev/null");
+
+    open($fh, ">", $image_file) or die "Cannot create $image_file: $!";
+    truncate($fh, ($g_part_start + $g_part_length) * $g_sector_size)
+	or die "Cannot truncate: $!";
+    close($fh);
+    write_bytes($image_file, 446,
+		pack("C C3 C C3 V V", 0, 0, 0, 0, 0x83, 0, 0, 0,
+		     $g_part_start, $g_part_length));
+    write_bytes($image_file, 510, pack("C2", 0x55, 0xAA));
+    run("dd if=$part_file of=$image_file bs=$g_sector_size " .
+	"seek=$g_part_start conv=notrunc status=none");
+    unlink($part_file);
+}
+
+##
+# What a mount and a clean unmount leave in the primary superblock only:
+# mount and write times, mount count, state, mount point, orphan list
+##
+sub mount_primary {
+    my ($image_file) = @_;
+    my $super = $g_part_start * $g_sector_size + $g_super_offset;
+    my $now = time();
+
+    write_bytes($image_file, $super + 44, pack("V V v", $now, $now, 1));
+    write_bytes($image_file, $super + 58, pack("v", 1));
+    write_bytes($image_file, $super + 136, pack("a64", "/mnt"));
+    write_bytes($image_file, $super + 232, pack("V", 12));
+}
+
+sub check {
+    my ($name, $ok) = @_;
+    print(($ok ? "PASS" : "FAIL") . ": $name\n");
+    $g_failures++ if (!$ok);
+}
+
+##
+# -B must neither report nor write anything on a clean filesystem
+##
+sub check_clean {
+    my ($name, $image_file) = @_;
+    my $copy_file = "$image_file.orig";
+    copy($image_file, $copy_file) or die "Cannot copy $image_file: $!";
+    my $output = `$g_myfsck_exec -i $image_file -f 1 -B 2>&1`;
+    check("$name: nothing reported", $? == 0 && $output eq "");
+    if ($output ne "") {
+	print "Got:\n$output";
+    }
+    check("$name: image unchanged", compare($image_file, $copy_file) == 0);
+    unlink($copy_file);
+}
+
+sub run_tests {
+    my $image_file = "$g_tmp_dir/backup_image";
+
+    make_image($image_file);
+    check_clean("-B after mke2fs", $image_file);
+    mount_primary($image_file);
+    check_clean("-B after mount", $image_file);
+
+    unlink($image_file);
+}
+
+
+#####
+
+get_options();
+run_tests();
+print "Found $g_failures failures\n";
+exit($g_failures == 0 ? 0 : -1);
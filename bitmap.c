@@ -0,0 +1,185 @@
+/*
+ * In-memory bitsets used while checking. The bit order is the same 
+ * as the on-disk bitmaps: bit 0 is the LEAST significant bit of byte 0.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "bitmap.h"
+
+/*
+ * Return how many bytes are needed to hold bits_num bits
+ */
+__u64 bitmap_bytes(__u64 bits_num) {
+    return (bits_num + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+}
+
+/*
+ * Allocate a bitset with all bits cleared
+ */
+char* bitmap_alloc(__u64 bits_num) {
+    return (char*)calloc(bitmap_bytes(bits_num), sizeof(char));
+}
+
+char bitmap_test(char* bitmap, __u32 bit) {
+    return (bitmap[bit / BITS_PER_BYTE] >> (bit % BITS_PER_BYTE)) & 1;
+}
+
+void bitmap_set(char* bitmap, __u32 bit) {
+    bitmap[bit / BITS_PER_BYTE] |= 1 << (bit % BITS_PER_BYTE);
+}
+
+void bitmap_clear(char* bitmap, __u32 bit) {
+    bitmap[bit / BITS_PER_BYTE] &= ~(1 << (bit % BITS_PER_BYTE));
+}
+
+/*
+ * Load the 64 bits starting at byte "bytes", bit 0 of the byte 
+ * becomes bit 0 of the word
+ */
+static __u64 load_word(char* bytes) {
+    __u64 word;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&word, bytes, sizeof(word));
+#else
+    int i;
+    word = 0;
+    for (i = 7; i >= 0; --i) {
+        word = (word << 8) | (unsigned char)bytes[i];
+    }
+#endif
+    return word;
+}
+
+/*
+ * Return the first set bit in [start, end), or end if there is none.
+ * Whole 64 bit words are skipped at once, the set bit inside a word 
+ * is found with count-trailing-zeros.
+ */
+__u32 bitmap_find_next(char* bitmap, __u32 start, __u32 end) {
+    __u32 bit = start;
+    while (bit < end && bit % 64 != 0) {
+        if (bitmap_test(bitmap, bit)) {
+            return bit;
+        }
+        ++bit;
+    }
+    while (bit + 64 <= end) {
+        __u64 word = load_word(bitmap + bit / BITS_PER_BYTE);
+        if (word != 0) {
+            return bit + __builtin_ctzll(word);
+        }
+        bit += 64;
+    }
+    while (bit < end) {
+        if (bitmap_test(bitmap, bit)) {
+            return bit;
+        }
+        ++bit;
+    }
+    return end;
+}
+
+/*
+ * Count the set bits of words 64 bits words starting at bytes
+ */
+static __u32 count_words_generic(char* bytes, __u32 words) {
+    __u32 count = 0, i;
+    for (i = 0; i < words; ++i) {
+        count += __builtin_popcountll(load_word(bytes + i * 8));
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Same as count_words_generic(), compiled to the popcnt instruction
+ */
+__attribute__((target("popcnt")))
+static __u32 count_words_popcnt(char* bytes, __u32 words) {
+    __u32 count = 0, i;
+    for (i = 0; i < words; ++i) {
+        count += __builtin_popcountll(load_word(bytes + i * 8));
+    }
+    return count;
+}
+#endif
+
+static __u32 count_words(char* bytes, __u32 words) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("popcnt")) {
+        return count_words_popcnt(bytes, words);
+    }
+#endif
+    return count_words_generic(bytes, words);
+}
+
+/*
+ * Return how many bits are set in [start, end).
+ * Whole 64 bits words are counted with popcount.
+ */
+__u32 bitmap_count(char* bitmap, __u32 start, __u32 end) {
+    __u32 count = 0;
+    __u32 bit = start;
+    while (bit < end && bit % 64 != 0) {
+        count += bitmap_test(bitmap, bit++);
+    }
+    if (bit + 64 <= end) {
+        __u32 words = (end - bit) / 64;
+        count += count_words(bitmap + bit / BITS_PER_BYTE, words);
+        bit += words * 64;
+    }
+    while (bit < end) {
+        count += bitmap_test(bitmap, bit++);
+    }
+    return count;
+}
+
+/*
+ * Set the bit and return its old value
+ */
+char bitmap_test_and_set(char* bitmap, __u32 bit) {
+    char old = bitmap_test(bitmap, bit);
+    bitmap_set(bitmap, bit);
+    return old;
+}
+
+/*
+ * dst |= src over the first bytes bytes. bytes must be a multiple of 8.
+ */
+void bitmap_or(char* dst, char* src, __u32 bytes) {
+    __u64 x, y;
+    __u32 i;
+    for (i = 0; i < bytes; i += sizeof(__u64)) {
+        memcpy(&x, dst + i, sizeof(x));
+        memcpy(&y, src + i, sizeof(y));
+        x |= y;
+        memcpy(dst + i, &x, sizeof(x));
+    }
+}
+
+/*
+ * XOR two bitmap blocks of the given size into diff.
+ * Return 1 if they differ anywhere.
+ */
+static ALWAYS_INLINE int bitmap_diff_sized(char* a, char* b, char* diff, 
+        __u32 size) {
+    __u64 x, y, any = 0;
+    __u32 i;
+    for (i = 0; i < size; i += sizeof(__u64)) {
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        x ^= y;
+        memcpy(diff + i, &x, sizeof(x));
+        any |= x;
+    }
+    return any != 0;
+}
+
+#define bitmap_diff_WRAPPER(suffix, size) \
+    static int bitmap_diff_##suffix(char* a, char* b, char* diff) { \
+        return bitmap_diff_sized(a, b, diff, size); \
+    }
+
+DEFINE_BLOCK_KERNELS(BitmapDiffBlockFunc, bitmap_diff, 
+        select_bitmap_diff_block)
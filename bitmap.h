@@ -0,0 +1,11 @@
+#include "common.h"
+
+char* bitmap_alloc(__u64 bits_num);
+__u64 bitmap_bytes(__u64 bits_num);
+char bitmap_test(char* bitmap, __u32 bit);
+void bitmap_set(char* bitmap, __u32 bit);
+void bitmap_clear(char* bitmap, __u32 bit);
+char bitmap_test_and_set(char* bitmap, __u32 bit);
+__u32 bitmap_find_next(char* bitmap, __u32 start, __u32 end);
+__u32 bitmap_count(char* bitmap, __u32 start, __u32 end);
+void bitmap_or(char* dst, char* src, __u32 bytes);
@@ -0,0 +1,31 @@
+/*
+ * Pick the block size specialized kernels.
+ *
+ * Directory entry walking, pointer block decoding, bitmap diffing and
+ * inode table decoding each have a variant compiled for 1KB, 2KB and 
+ * 4KB blocks, and a generic one reading block_size at run time for any
+ * other size. The set is chosen once per partition, right after the
+ * superblock is read, so the hot loops never test the block size.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+
+extern DirEntryNextFunc select_dir_entry_next(__u32 size);
+extern DecodePointerBlockFunc select_decode_pointer_block(__u32 size);
+extern BitmapDiffBlockFunc select_bitmap_diff_block(__u32 size);
+extern SummarizeInodeBlockFunc select_summarize_inode_block(__u32 size);
+
+/*
+ * Select the kernels for the current partition's block size.
+ * Must be called after read_super_block()
+ */
+void select_block_kernels() {
+    block_kernels.dir_entry_next = select_dir_entry_next(block_size);
+    block_kernels.decode_pointer_block = 
+        select_decode_pointer_block(block_size);
+    block_kernels.bitmap_diff_block = select_bitmap_diff_block(block_size);
+    block_kernels.summarize_inode_block = 
+        select_summarize_inode_block(block_size);
+}
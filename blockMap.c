@@ -0,0 +1,279 @@
+/*
+ * Walk the block map of an inode and return it as runs of
+ * contiguous blocks.
+ *
+ * The 12 direct pointers map logical blocks 0-11, i_block[12] points 
+ * to an indirect block, i_block[13] to a double indirect block and 
+ * i_block[14] to a triple indirect block. Pointer blocks that are 
+ * children of the same parent are read BLOCK_MAP_BATCH at a time, 
+ * so neighbouring pointer blocks are fetched in one request.
+ * Every pointer is range checked (see pointerBlock.c) and pointers
+ * outside the filesystem are skipped and counted in iter.bad_num.
+ *
+ * Usage:
+ *     block_map_init(&iter, &inode);
+ *     while (block_map_next(&iter, &run)) {
+ *         ...
+ *     }
+ *     block_map_free(&iter);
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+#include "util.h"
+#include "readPlan.h"
+
+extern __u32 pointer_mask_words(__u32 count);
+
+static int next_block(BlockMapIter* iter, BlockRun* run);
+static void load_batch(BlockMapIter* iter, int level);
+
+/*
+ * A block number that can be used as an index: [first data block, 
+ * number of blocks)
+ */
+static int block_in_fs(__u32 block_id) {
+    return block_id >= super_block.s_first_data_block &&
+        block_id < super_block.s_blocks_count;
+}
+
+/*
+ * Only regular files, directories and symbolic links that do not
+ * fit into i_block own data blocks.
+ */
+static int inode_has_blocks(struct ext2_inode* inode) {
+    if (INODE_IS_LNK(inode)) {
+        return inode->i_blocks != 0;
+    }
+    return INODE_IS_REG(inode) || INODE_IS_DIR(inode);
+}
+
+/*
+ * Number of logical blocks mapped by one pointer on the given level.
+ * A pointer on level 1 maps one data block.
+ */
+static __u64 level_span(int level) {
+    __u64 pointers_per_block = block_size / 4;
+    __u64 span = 1;
+    while (--level > 0) {
+        span *= pointers_per_block;
+    }
+    return span;
+}
+
+void block_map_init(BlockMapIter* iter, struct ext2_inode* inode) {
+    memset(iter, 0, sizeof(BlockMapIter));
+    if (inode_has_blocks(inode)) {
+        memcpy(iter->i_block, inode->i_block, sizeof(iter->i_block));
+    } else {
+        iter->slot = EXT2_N_BLOCKS;
+    }
+}
+
+void block_map_free(BlockMapIter* iter) {
+    int i;
+    for (i = 1; i <= BLOCK_MAP_MAX_LEVEL; ++i) {
+        BlockMapLevel* level = &iter->levels[i];
+        if (level->blocks == NULL) {
+            continue;
+        }
+        free(level->blocks);
+        free(level->pointers.pointers);
+        free(level->pointers.index);
+        free(level->pointers.hole_mask);
+        free(level->pointers.bad_mask);
+        level->blocks = NULL;
+    }
+}
+
+/*
+ * Return the next run of the file in *run.
+ * Data blocks that are contiguous both logically and physically, and 
+ * pointer blocks of the same level that are physically contiguous, 
+ * are merged into one run.
+ * Return 1 if a run is found, 0 when the whole map has been walked.
+ */
+int block_map_next(BlockMapIter* iter, BlockRun* run) {
+    BlockRun next;
+    if (iter->has_peek) {
+        *run = iter->peek;
+        iter->has_peek = 0;
+    } else if (!next_block(iter, run)) {
+        return 0;
+    }
+    while (next_block(iter, &next)) {
+        if (next.level == run->level && 
+                next.physical == run->physical + run->length &&
+                (run->level != 0 || 
+                 next.logical == run->logical + run->length)) {
+            ++run->length;
+        } else {
+            iter->peek = next;
+            iter->has_peek = 1;
+            break;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Same as block_map_next, but only return runs of data blocks.
+ */
+int block_map_next_data(BlockMapIter* iter, BlockRun* run) {
+    while (block_map_next(iter, run)) {
+        if (run->level == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return the next single block of the map. Holes are skipped.
+ */
+static int next_block(BlockMapIter* iter, BlockRun* run) {
+    BlockMapLevel* level;
+    PointerBlock* pb;
+    __u32 block_id;
+    __u64 logical;
+
+    while (1) {
+        // pointer blocks of a new batch are returned before their children
+        if (iter->meta_left > 0) {
+            level = &iter->levels[iter->active];
+            __u32 i = level->num - iter->meta_left--;
+            run->logical = level->logical[i];
+            run->physical = level->ids[i];
+            run->length = 1;
+            run->level = iter->active;
+            return 1;
+        }
+
+        if (iter->top == 0) {
+            if (iter->slot >= EXT2_N_BLOCKS) {
+                return 0;
+            }
+            int slot = iter->slot++;
+            block_id = iter->i_block[slot];
+            if (block_id == 0) {
+                continue;
+            }
+            if (!block_in_fs(block_id)) {
+                ++iter->bad_num;
+                continue;
+            }
+            if (slot < EXT2_NDIR_BLOCKS) {
+                run->logical = slot;
+                run->physical = block_id;
+                run->length = 1;
+                run->level = 0;
+                return 1;
+            }
+            // start walking an indirect tree
+            iter->top = slot - EXT2_NDIR_BLOCKS + 1;
+            logical = EXT2_NDIR_BLOCKS;
+            int i;
+            for (i = 1; i < iter->top; ++i) {
+                logical += level_span(i + 1);
+            }
+            level = &iter->levels[iter->top];
+            level->ids[0] = block_id;
+            level->logical[0] = logical > 0xFFFFFFFF? 0xFFFFFFFF: logical;
+            level->num = 1;
+            load_batch(iter, iter->top);
+            continue;
+        }
+
+        level = &iter->levels[iter->active];
+        if (level->cur >= level->num) {
+            // the batch is done, go back to its parent
+            if (iter->active == iter->top) {
+                iter->top = 0;
+            } else {
+                ++iter->active;
+            }
+            continue;
+        }
+        pb = &level->pointers;
+        if (level->decoded != level->cur) {
+            block_kernels.decode_pointer_block(
+                    level->blocks + level->cur * block_size,
+                    super_block.s_first_data_block,
+                    super_block.s_blocks_count, pb);
+            iter->bad_num += pb->bad_num;
+            level->decoded = level->cur;
+        }
+        if (level->pos >= pb->num) {
+            ++level->cur;
+            level->pos = 0;
+            continue;
+        }
+
+        block_id = pb->pointers[level->pos];
+        logical = level->logical[level->cur] + 
+            pb->index[level->pos] * level_span(iter->active);
+        ++level->pos;
+        if (logical > 0xFFFFFFFF) {
+            continue;
+        }
+        if (iter->active == 1) {
+            run->logical = logical;
+            run->physical = block_id;
+            run->length = 1;
+            run->level = 0;
+            return 1;
+        }
+
+        // collect this child pointer block and its following siblings
+        BlockMapLevel* child = &iter->levels[iter->active - 1];
+        child->num = 0;
+        child->ids[child->num] = block_id;
+        child->logical[child->num++] = logical;
+        while (child->num < BLOCK_MAP_BATCH && level->pos < pb->num) {
+            block_id = pb->pointers[level->pos];
+            logical = level->logical[level->cur] + 
+                pb->index[level->pos] * level_span(iter->active);
+            ++level->pos;
+            if (logical > 0xFFFFFFFF) {
+                continue;
+            }
+            child->ids[child->num] = block_id;
+            child->logical[child->num++] = logical;
+        }
+        load_batch(iter, iter->active - 1);
+    }
+}
+
+/*
+ * Read the pointer blocks listed in a level's batch and make it the
+ * active level. The blocks are read with a plan, so nearby blocks
+ * share one request.
+ */
+static void load_batch(BlockMapIter* iter, int level_num) {
+    BlockMapLevel* level = &iter->levels[level_num];
+    __u32 pointers_per_block = block_size / 4;
+    __u32 words = pointer_mask_words(pointers_per_block);
+    if (level->blocks == NULL) {
+        level->blocks = (char*)malloc(BLOCK_MAP_BATCH * block_size);
+        level->pointers.pointers = 
+            (__u32*)malloc(pointers_per_block * sizeof(__u32));
+        level->pointers.index = 
+            (__u16*)malloc(pointers_per_block * sizeof(__u16));
+        level->pointers.hole_mask = (__u64*)malloc(words * sizeof(__u64));
+        level->pointers.bad_mask = (__u64*)malloc(words * sizeof(__u64));
+    }
+    ReadPlan plan;
+    __u32 i;
+    read_plan_init(&plan, read_gap_blocks);
+    for (i = 0; i < level->num; ++i) {
+        read_plan_add(&plan, level->ids[i], level->blocks + i * block_size);
+    }
+    read_plan_execute(&plan);
+    read_plan_free(&plan);
+    level->cur = 0;
+    level->pos = 0;
+    level->decoded = BLOCK_MAP_BATCH;
+    iter->active = level_num;
+    iter->meta_left = level->num;
+}
@@ -3,6 +3,7 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <string.h>
 
@@ -29,9 +30,10 @@
  * Judging file type from inode
  * The leftmost 4 bits of inode.i_mode is file type values
  */
-#define INODE_IS_DIR(inode) ((inode)->i_mode & 0xF000)==EXT2_S_IFDIR
-#define INODE_IS_REG(inode) ((inode)->i_mode & 0xF000)==EXT2_S_IFREG
-#define INODE_IS_LNK(inode) ((inode)->i_mode & 0xF000)==EXT2_S_IFLNK
+#define INODE_IS_DIR(inode) (((inode)->i_mode & 0xF000)==EXT2_S_IFDIR)
+#define INODE_IS_REG(inode) (((inode)->i_mode & 0xF000)==EXT2_S_IFREG)
+#define INODE_IS_LNK(inode) (((inode)->i_mode & 0xF000)==EXT2_S_IFLNK)
+#define MODE_IS_DIR(mode) (((mode) & 0xF000)==EXT2_S_IFDIR)
 
 /*
  * Juding file type from directory entry, only can judge 
@@ -39,23 +41,245 @@
  */
 #define REG_TYPE 1
 #define DIR_TYPE 2
-#define DIR_IS_REG(dir_entry) (dir_entry)->file_type==REG_TYPE
-#define DIR_IS_DIR(dir_entry) (dir_entry)->file_type==DIR_TYPE
+#define DIR_IS_REG(dir_entry) ((dir_entry)->file_type==REG_TYPE)
+#define DIR_IS_DIR(dir_entry) ((dir_entry)->file_type==DIR_TYPE)
+
+// ext2_dir_entry_2's entry length excluding name length
+#define DIR_ENTRY_PREFIX_LEN 8
+
+/*
+ * Decode little endian numbers straight from on-disk bytes
+ */
+#define GET_LE16(p) ((__u16)((p)[0] | (p)[1] << 8))
+#define GET_LE32(p) ((__u32)(p)[0] | (__u32)(p)[1] << 8 | \
+        (__u32)(p)[2] << 16 | (__u32)(p)[3] << 24)
 
 typedef struct PartitionEntry {
     unsigned char type;
-    unsigned int start;
-    unsigned int length;
+    __u64 start;   /* in sectors, 64 bits so byte offsets never wrap */
+    __u64 length;
 } PartitionEntry;
 
+/*
+ * A view of one directory entry inside a directory block.
+ * name points into the block and is NOT null terminated.
+ */
+typedef struct DirEntry {
+    __u32 inode;
+    __u16 rec_len;
+    __u8 name_len;
+    __u8 file_type;
+    __u32 offset;  /* offset of the entry in its block */
+    char* name;
+} DirEntry;
+
+/*
+ * A run of physically contiguous blocks of a file.
+ * level 0 runs are data blocks starting at logical block "logical".
+ * level 1..3 runs are (double, triple) indirect pointer blocks, and 
+ * "logical" is the first logical block they map.
+ */
+typedef struct BlockRun {
+    __u32 logical;
+    __u32 physical;
+    __u32 length;
+    int level;
+} BlockRun;
+
+/*
+ * Structure of arrays holding the inode fields the passes need,
+ * indexed by inode number. See inodeSummary.c.
+ */
+typedef struct InodeSummary {
+    __u32 inodes_count;
+    __u16* mode;
+    __u16* links_count;
+    __u32* size;
+    __u32* blocks;      /* i_blocks, in 512 bytes units */
+    char* dtime;        /* bitset, set if i_dtime is not 0 */
+} InodeSummary;
+
+/*
+ * A decoded pointer block. See pointerBlock.c.
+ */
+typedef struct PointerBlock {
+    __u32 num;        /* valid pointers */
+    __u32 bad_num;    /* pointers out of range */
+    __u32* pointers;  /* valid pointers, in block order */
+    __u16* index;     /* position of each valid pointer in the block */
+    __u64* hole_mask; /* one bit per zero pointer */
+    __u64* bad_mask;  /* one bit per pointer out of range */
+} PointerBlock;
+
+/*
+ * Hot loops compiled for a fixed block size, chosen once after the
+ * superblock is read. See blockKernels.c.
+ */
+typedef int (*DirEntryNextFunc)(char* dir_block, __u32* offset, 
+        DirEntry* entry);
+typedef __u32 (*DecodePointerBlockFunc)(char* block, __u32 first, 
+        __u32 end, PointerBlock* pb);
+typedef int (*BitmapDiffBlockFunc)(char* a, char* b, char* diff);
+typedef void (*SummarizeInodeBlockFunc)(char* block, __u32 first_inode);
+
+typedef struct BlockKernels {
+    DirEntryNextFunc dir_entry_next;
+    DecodePointerBlockFunc decode_pointer_block;
+    BitmapDiffBlockFunc bitmap_diff_block;
+    SummarizeInodeBlockFunc summarize_inode_block;
+} BlockKernels;
+
+/*
+ * Kernel bodies take the block size as a parameter and are always
+ * inlined into one wrapper per supported block size, so each copy is
+ * compiled with a constant trip count.
+ */
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/*
+ * Define the wrappers name_1024, name_2048, name_4096 and name_generic
+ * with name##_WRAPPER(suffix, size), which the kernel's file provides,
+ * and select(size) returning the one for a block size.
+ */
+#define DEFINE_BLOCK_KERNELS(type, name, select) \
+    name##_WRAPPER(1024, 1024) \
+    name##_WRAPPER(2048, 2048) \
+    name##_WRAPPER(4096, 4096) \
+    name##_WRAPPER(generic, block_size) \
+    type select(__u32 size) { \
+        switch (size) { \
+            case 1024: return name##_1024; \
+            case 2048: return name##_2048; \
+            case 4096: return name##_4096; \
+            default: return name##_generic; \
+        } \
+    }
+
+#define BLOCK_MAP_BATCH 16  /* sibling pointer blocks read at once */
+#define BLOCK_MAP_MAX_LEVEL 3
+
+/*
+ * A batch of pointer blocks on one level of the indirect tree.
+ * All blocks of a batch are children of the same parent block.
+ */
+typedef struct BlockMapLevel {
+    char* blocks;
+    __u32 ids[BLOCK_MAP_BATCH];
+    __u32 logical[BLOCK_MAP_BATCH];  /* first logical block of each */
+    __u32 num;   /* pointer blocks in the batch */
+    __u32 cur;   /* pointer block being walked */
+    __u32 pos;   /* next valid pointer in the current block */
+    __u32 decoded; /* batch block in "pointers", BLOCK_MAP_BATCH if none */
+    PointerBlock pointers;
+} BlockMapLevel;
+
+/*
+ * Walks the block map of one inode: direct, indirect, double and 
+ * triple indirect blocks. See blockMap.c.
+ */
+typedef struct BlockMapIter {
+    __u32 i_block[EXT2_N_BLOCKS];
+    int slot;        /* next slot of i_block to look at */
+    int top;         /* depth of the tree being walked, 0 if none */
+    int active;      /* level whose batch is being walked */
+    __u32 meta_left; /* pointer blocks of a new batch not yet returned */
+    __u32 bad_num;   /* pointers outside the filesystem, skipped */
+    int has_peek;
+    BlockRun peek;
+    BlockMapLevel levels[BLOCK_MAP_MAX_LEVEL + 1];
+} BlockMapIter;
+
+/*
+ * Metadata blocks of one block group. A length of 0 means the group 
+ * holds no copy of that structure. See groupLayout.c.
+ */
+typedef struct GroupLayout {
+    __u32 super_block;        /* superblock copy */
+    __u32 super_block_num;
+    __u32 gdt;                /* group descriptor table copy */
+    __u32 gdt_num;            /* including the reserved GDT blocks */
+    __u32 block_bitmap;
+    __u32 block_bitmap_num;
+    __u32 inode_bitmap;
+    __u32 inode_bitmap_num;
+    __u32 inode_table;
+    __u32 inode_table_num;
+} GroupLayout;
+
+/*
+ * One inode's claim on a multiply-claimed block, see dupBlock.c
+ */
+typedef struct BlockClaim {
+    __u32 block;
+    __u32 inode_num;
+} BlockClaim;
+
+/*
+ * A block wanted by a read plan and the buffer it goes to.
+ * See readPlan.c.
+ */
+typedef struct ReadPlanEntry {
+    __u32 block;
+    char* into;
+} ReadPlanEntry;
+
+#define READ_GAP_DEFAULT 8     /* unwanted blocks a plan may read through */
+#define READ_PLAN_MAX_BLOCKS 256  /* blocks covered by one request */
+
+typedef struct ReadPlan {
+    ReadPlanEntry* entries;
+    __u32 num;
+    __u32 capacity;
+    __u32 gap;  /* longest run of unwanted blocks read to merge requests */
+} ReadPlan;
+
+#define DIR_READ_BATCH 16  /* directory blocks of a run read at once */
+#define BITMAP_READ_GROUPS 64  /* groups whose bitmaps are planned at once */
+
+/*
+ * Walks the entries of one directory block without copying them.
+ * index is the position of the current entry, starting from 0.
+ */
+typedef struct DirEntryIter {
+    char* dir_block;
+    __u32 offset;
+    int index;
+} DirEntryIter;
+
 int device;  /* disk image file descriptor */
 struct ext2_super_block super_block;
 __u32 block_size;
 PartitionEntry partition_entry;
-char* group_desc_block;
+PartitionEntry* partition_table;  /* MBR entries, then logical partitions */
+int partition_table_num;
+struct ext2_group_desc* group_descs;  /* decoded group descriptor table */
+__u32 group_desc_num;
+InodeSummary inode_summary;
+char* inode_bitmap;  /* on-disk inode bitmap, bit (n - 1) is inode n */
+char* block_bitmap;  /* block bitmap fixed by pass4, packed like on disk */
+char* used_inode_bitmap;  /* inodes found in use by pass3 */
+__u16* dir_links_count;  /* entries pointing to each inode, by pass3 */
+GroupLayout* group_layouts;  /* metadata blocks of every group */
+char* meta_block_bitmap;  /* packed like the block bitmap, 1 = metadata */
+BlockKernels block_kernels;
+char* visited_dir_bitmap;  /* inodes expanded by the current walk */
+char* dup_block_bitmap;  /* blocks claimed twice during pass4's walk */
+char check_super_copies;  /* -B: validate every superblock and GDT copy */
+char direct_io;  /* --direct: O_DIRECT reads through our own buffers */
+char compressed_image;  /* -i is a zstd seekable image, read only */
+char use_overlay;  /* --overlay: writes go to the overlay file */
+__u32 read_gap_blocks;  /* --read-gap: gap tolerance of read plans */
 
 
 extern void print_sector (unsigned char *buf);
-extern void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into);
-extern void write_sectors (int64_t start_sector, unsigned int num_sectors, void *from);
+extern int pread_sectors (int fd, int64_t start_sector, unsigned int num_sectors, void *into);
+extern int pwrite_sectors (int fd, int64_t start_sector, unsigned int num_sectors, const void *from);
+extern int preadv_sectors (int fd, int64_t start_sector, const struct iovec *iov, int iovcnt);
+extern int pwritev_sectors (int fd, int64_t start_sector, const struct iovec *iov, int iovcnt);
+extern int read_sectors (int64_t start_sector, unsigned int num_sectors, void *into);
+extern int read_sectors_vec (int64_t start_sector, const struct iovec *iov, int iovcnt);
+extern int write_sectors (int64_t start_sector, unsigned int num_sectors, void *from);
+extern int64_t get_image_size (void);
+extern int hole_map_init (void);
+extern int image_range_is_hole (int64_t offset, size_t len);
 
@@ -11,6 +11,7 @@
  */
 #include "common.h"
 #include "util.h"
+#include "report.h"
 #include "correct.h"
 
 
@@ -32,46 +33,48 @@ void pass1(__u32 parent_inode_num, __u32 inode_num) {
         return;
     }
 
-    char dir_block[block_size];
-    struct ext2_dir_entry_2 entry;
-
-    int i;
-    for (i = 0; i < EXT2_N_BLOCKS; ++i) {
-        __u32 block_id = inode.i_block[i];
-        if (block_id == 0) {
-            break;
-        }
+    char* dir_blocks = (char*)malloc(DIR_READ_BATCH * block_size);
+    char* dir_block;
+    DirEntryIter iter;
+    DirEntry entry;
+    BlockMapIter map;
+    BlockRun run;
 
-        read_block(block_id, block_size, dir_block);
-
-        int offset = 0;
-        int len;
-        int count = 0;
-        while (offset < block_size) {
-            len = read_dir_entry_in_block(dir_block, offset, &entry);
-            if (len < 0) {
-                break;
-            }
-            if (DIR_IS_DIR(&entry)) {  // continue searching if is directory
-                if (count == 0) {
+    __u32 i;
+    block_map_init(&map, &inode);
+    while (block_map_next_data(&map, &run)) {
+        for (i = 0; i < run.length; ++i) {
+            __u32 block_id = run.physical + i;
+            int first_block = (run.logical + i == 0);
+            dir_block = dir_run_block(&run, i, dir_blocks);
+
+            dir_iter_init(&iter, dir_block);
+            while (dir_iter_next(&iter, &entry)) {
+                if (!DIR_IS_DIR(&entry)) {  // only searching directories
+                    continue;
+                }
+                if (first_block && iter.index == 0) {
                     if (entry.inode != inode_num) {
                         print_dir_entry_error(inode_num, &entry);
-                        pass1_corrector(dir_block, block_id, offset, inode_num);
+                        pass1_corrector(dir_block, block_id, 
+                                entry.offset, inode_num);
                     } 
-                } else if (count == 1) {
+                } else if (first_block && iter.index == 1) {
                     if (entry.inode != parent_inode_num) {
                         print_dir_entry_error(parent_inode_num, &entry);
-                        pass1_corrector(dir_block, block_id, offset, 
+                        pass1_corrector(dir_block, block_id, entry.offset, 
                                 parent_inode_num);
                     }
+                } else if (visit_dir(entry.inode)) {
+                    print_dir_loop_error(inode_num, &entry);
                 } else {
                     pass1(inode_num, entry.inode);
                 }
             }
-            offset += len;
-            ++count;
         }
     }
+    block_map_free(&map);
+    free(dir_blocks);
 }
 
 /*
@@ -100,75 +103,82 @@ void pass2() {
      * compare it with the alloc inode bitmap.
      */
 
-    char* inode_links_count = 
-        (char*)calloc((super_block.s_inodes_count + 1), sizeof(char));
-    int i;
+    __u16* inode_links_count = 
+        (__u16*)calloc((size_t)super_block.s_inodes_count + 1, sizeof(__u16));
+    __u32 i;
+    start_dir_walk(ROOT_INODE_NUM);
     directory_traversor(inode_links_count, ROOT_INODE_NUM);
-    // get the partition's inode 
-    char* bitmap = get_inode_bitmap_in_partition();
-
-    struct ext2_inode inode;
-    char alloc_bit;
-    for (i = 1; i <= super_block.s_inodes_count; ++i) {
-        inode = read_inode(i);
-        if (inode.i_links_count == 0) {  
+
+    // only visit the inodes allocated in the inode bitmap
+    for (i = next_alloc_inode(inode_bitmap, 1); i != 0; 
+            i = next_alloc_inode(inode_bitmap, i + 1)) {
+        if (inode_summary.links_count[i] == 0) {  
             continue;
         }
-        alloc_bit = get_inode_alloc_bit(bitmap, i);
-        if (alloc_bit == 1 && inode_links_count[i] == 0) {
-            printf("Unreferenced inodes: %u\n", i);
-            if (INODE_IS_DIR(&inode)) {
+        if (inode_links_count[i] == 0) {
+            report(REPORT_UNREFERENCED, i, 0, 0);
+            if (MODE_IS_DIR(inode_summary.mode[i])) {
                 /* All contents in an unreferenced directory are 
                  * unreference as well. I only put the topmost 
                  * unreferenced directory into lost+found.*/
-                directory_traversor(inode_links_count, i);
+                if (!visit_dir(i)) {
+                    directory_traversor(inode_links_count, i);
+                }
             }
             add_to_lost_found(inode_links_count, i);
         }
     }
 
     free(inode_links_count);
-    free(bitmap);
 }
 
-void directory_traversor(char* inode_links_count, __u32 inode_num) {
+/*
+ * Count the directory entries pointing to each inode under the given
+ * directory. The caller must have marked inode_num as visited.
+ */
+void directory_traversor(__u16* inode_links_count, __u32 inode_num) {
     struct ext2_inode inode = read_inode(inode_num);
-    char dir_block[block_size];
+    char* dir_blocks = (char*)malloc(DIR_READ_BATCH * block_size);
+    char* dir_block;
+    DirEntryIter iter;
+    DirEntry entry;
+    BlockMapIter map;
+    BlockRun run;
 
-    int i;
-    for (i = 0; i < EXT2_N_BLOCKS; ++i) {
-        __u32 block_id = inode.i_block[i];
-        if (block_id == 0) {
-            break;
-        }
-        read_block(block_id, block_size, dir_block);
-
-        int offset = 0;
-        int len;
-        int count = 0;
-        struct ext2_dir_entry_2 entry;
-        while (offset < block_size) {
-            len = read_dir_entry_in_block(dir_block, offset, &entry);
-            if (len < 0) {
-                break;
-            } 
-            inode_links_count[entry.inode]++;
-            if (i != 0 || count >= 2) {
-                if (DIR_IS_DIR(&entry)) {
+    __u32 i;
+    block_map_init(&map, &inode);
+    while (block_map_next_data(&map, &run)) {
+        for (i = 0; i < run.length; ++i) {
+            dir_block = dir_run_block(&run, i, dir_blocks);
+
+            dir_iter_init(&iter, dir_block);
+            while (dir_iter_next(&iter, &entry)) {
+                if (entry.inode > super_block.s_inodes_count) {
+                    continue;
+                }
+                inode_links_count[entry.inode]++;
+                if (run.logical + i == 0 && iter.index < 2) {
+                    continue;
+                }
+                // a directory linked twice is only expanded once
+                if (DIR_IS_DIR(&entry) && !visit_dir(entry.inode)) {
                     directory_traversor(inode_links_count, entry.inode);
                 }
             }
-            offset += len;
-            ++count;
         }
     }
+    block_map_free(&map);
+    free(dir_blocks);
 }
 
 /*
  * Add the unreferenced inodes into lost+found directory
- * Return -1 if cannot find the directory
+ * A block with no used entry (a preallocated lost+found block holds a 
+ * single inode 0 entry spanning the block) takes the new entry at 
+ * offset 0.
+ * Return -1 if cannot find the directory or it has no room left
  */
-int add_to_lost_found(char* inode_links_count, __u32 inode_num) {
+int add_to_lost_found(__u16* inode_links_count, __u32 inode_num) {
     struct ext2_dir_entry_2 lost_found_dir;
     struct ext2_inode root_inode = read_inode(ROOT_INODE_NUM);
     if (search_dir_entry(&root_inode, 
@@ -183,42 +193,60 @@ int add_to_lost_found(char* inode_links_count, __u32 inode_num) {
 
     __u32 block_id;
     char dir_block[block_size];
-    struct ext2_dir_entry_2 entry;
-    int offset, len;
-    int i;
-    for (i = 0; i < EXT2_N_BLOCKS; ++i) {
-        block_id = lost_found_inode.i_block[i];
-        if (block_id == 0) {
-            break;
-        }
-        read_block(block_id, block_size, dir_block);
-
-        offset = 0;
-        // find the last entry
-        while (offset < block_size) {
-            len = read_dir_entry_in_block(dir_block, offset, &entry);
-            if (len < 0) {
+    DirEntryIter iter;
+    DirEntry entry, last_entry;
+    BlockMapIter map;
+    BlockRun run;
+    int added = 0;
+    __u32 i;
+    block_map_init(&map, &lost_found_inode);
+    while (!added && block_map_next_data(&map, &run)) {
+        for (i = 0; i < run.length; ++i) {
+            block_id = run.physical + i;
+            read_block(block_id, block_size, dir_block);
+
+            // find the last entry
+            dir_iter_init(&iter, dir_block);
+            while (dir_iter_next(&iter, &entry)) {
+                last_entry = entry;
+            }
+            if (iter.index < 0) {
+                // an empty block, unless it is corrupt
+                unsigned char* p = (unsigned char*)dir_block;
+                if (GET_LE32(p) == 0 && GET_LE16(p + 4) == block_size) {
+                    write_new_entry(&new_entry, dir_block, block_id, 0);
+                    added = 1;
+                    break;
+                }
+                continue;
+            }
+            // get the last entry's real length
+            __u32 offset = last_entry.offset;
+            __u32 real_len = 
+                pad_to_4_bytes(DIR_ENTRY_PREFIX_LEN + last_entry.name_len);
+            // enough space to put the new entry
+            if (offset + real_len + new_entry.rec_len < block_size) {
+                // rewrite the last entry's rec_len
+                write_number_into_block(dir_block, offset + 4, real_len, 2);
+                write_new_entry(&new_entry, dir_block, 
+                        block_id, offset + real_len);
+                added = 1;
                 break;
-            } 
-            offset += len;
-        }
-        // get the last entry's real length
-        offset -= len;
-        __u32 real_len = pad_to_4_bytes(DIR_ENTRY_PREFIX_LEN + entry.name_len);
-        // enough space to put the new entry
-        if (offset + real_len + new_entry.rec_len < block_size) {
-            // rewrite the last entry's rec_len
-            write_number_into_block(dir_block, offset + 4, real_len, 2);
-            write_new_entry(&new_entry, dir_block, block_id, offset + real_len);
-            break;
+            }
         }
     }
+    block_map_free(&map);
+    if (!added) {
+        printf("no room in lost+found for inode %u\n", inode_num);
+        return -1;
+    }
     // set inode's parent dir to lost+found
     struct ext2_inode inode = read_inode(inode_num);
     read_block(inode.i_block[0], block_size, dir_block);
     write_number_into_block(dir_block, FIRST_ENTRY_LEN, 
             lost_found_dir.inode, 4);
     write_block(inode.i_block[0], block_size, dir_block);
+    return 0;
 }
 
 /*
@@ -228,8 +256,7 @@ struct ext2_dir_entry_2 create_new_entry(__u32 inode_num) {
     struct ext2_dir_entry_2 new_entry;
     new_entry.inode = inode_num;
     
-    struct ext2_inode inode = read_inode(inode_num);
-    if (INODE_IS_DIR(&inode)) {
+    if (MODE_IS_DIR(inode_summary.mode[inode_num])) {
         new_entry.file_type = DIR_TYPE;
     } else {
         new_entry.file_type = REG_TYPE;
@@ -276,19 +303,111 @@ void write_new_entry(struct ext2_dir_entry_2* entry, char* dir_block,
  * and update the inode link counter.
  */
 void pass3() {
-    char* inode_links_count 
-        = (char*)calloc((super_block.s_inodes_count + 1), sizeof(char));
+    __u32 inodes_count = super_block.s_inodes_count;
+    __u16* inode_links_count 
+        = (__u16*)calloc((size_t)inodes_count + 1, sizeof(__u16));
+    __u16* links_count = inode_summary.links_count;
+    start_dir_walk(ROOT_INODE_NUM);
     directory_traversor(inode_links_count, ROOT_INODE_NUM);
+    used_inode_bitmap = (char*)calloc(get_inode_bitmap_bytes(), 
+            sizeof(char));
+    __u32 i, j, end, diff;
+    __u64 used;
+    for (i = 1; i <= inodes_count; i += LINKS_COMPARE_CHUNK) {
+        end = i + LINKS_COMPARE_CHUNK;
+        if (end > inodes_count + 1) {
+            end = inodes_count + 1;
+        }
+        // branch free, so the compiler can vectorize it
+        diff = 0;
+        used = 0;
+        for (j = i; j < end; ++j) {
+            diff |= links_count[j] ^ inode_links_count[j];
+            // referenced, or allocated and still linked somewhere
+            used |= (__u64)((links_count[j] | inode_links_count[j]) != 0) 
+                << (j - i);
+        }
+        for (j = 0; j < 8; ++j) {
+            used_inode_bitmap[(i - 1) / BITS_PER_BYTE + j] = 
+                (used >> (j * BITS_PER_BYTE)) & 0xFF;
+        }
+        if (diff == 0) {
+            continue;
+        }
+        for (j = i; j < end; ++j) {
+            // free inodes are not in the summary, leave them alone
+            if (links_count[j] != inode_links_count[j] && 
+                    get_inode_alloc_bit(inode_bitmap, j)) {
+                report(REPORT_LINKS_COUNT, j, links_count[j], 
+                        inode_links_count[j]);
+                write_inode(j, inode_links_count[j]);
+            }
+        }
+    }
+    // check_inode_bitmap fixes the inodes it marks in use with it
+    dir_links_count = inode_links_count;
+}
+
+/*
+ * Verify the inode bitmap against the inodes found in use by pass3,
+ * plus the reserved inodes. The bitmaps are compared a block at a 
+ * time, and only the groups with a wrong bit are written back.
+ * It runs before pass4, so that the blocks of an inode it marks in 
+ * use are counted as allocated too. pass3 skipped the links count of 
+ * such an inode, so it is fixed here.
+ */
+void check_inode_bitmap() {
+    __u32 size = get_inode_bitmap_bytes();
+    __u32 inodes_count = super_block.s_inodes_count;
+    char* diff = (char*)malloc(size);
     __u32 i;
-    for (i = 1; i <= super_block.s_inodes_count; ++i) {
-        struct ext2_inode inode = read_inode(i);
-        if (inode.i_links_count != inode_links_count[i]) {
-            printf("Inode %u ref count is %u, should be %u\n", 
-                    i, inode.i_links_count, inode_links_count[i]);
-            write_inode(i, inode_links_count[i]);
+
+    for (i = 1; i < EXT2_FIRST_INO(&super_block) && i <= inodes_count; 
+            ++i) {
+        bitmap_set(used_inode_bitmap, i - 1);
+    }
+
+    char found_error = 0;
+    for (i = 0; i < size; i += block_size) {
+        found_error |= block_kernels.bitmap_diff_block(inode_bitmap + i,
+                used_inode_bitmap + i, diff + i);
+    }
+    if (found_error) {
+        found_error = 0;
+        __u32 bit = bitmap_find_next(diff, 0, inodes_count);
+        while (bit < inodes_count) {
+            __u32 inode_num = bit + 1;
+            if (bitmap_test(inode_bitmap, bit)) {
+                // allocated, but neither linked nor referenced
+                report(REPORT_INODE_UNUSED, inode_num, 0, 0);
+                bitmap_clear(inode_bitmap, bit);
+                found_error = 1;
+            } else {
+                // referenced by an entry, keep it only if it is live
+                struct ext2_inode inode = read_inode(inode_num);
+                if (inode_num < EXT2_FIRST_INO(&super_block) ||
+                        (inode.i_links_count > 0 && inode.i_dtime == 0)) {
+                    report(REPORT_INODE_UNMARKED, inode_num, 0, 0);
+                    bitmap_set(inode_bitmap, bit);
+                    __u16 links = dir_links_count[inode_num];
+                    if (links != 0 && links != inode.i_links_count) {
+                        report(REPORT_LINKS_COUNT, inode_num, 
+                                inode.i_links_count, links);
+                        write_inode(inode_num, links);
+                        inode.i_links_count = links;
+                    }
+                    add_to_inode_summary(inode_num, &inode);
+                    found_error = 1;
+                }
+            }
+            bit = bitmap_find_next(diff, bit + 1, inodes_count);
         }
     }
-    free(inode_links_count);
+
+    if (found_error == 1) {
+        write_inode_bitmap_in_partition(inode_bitmap);
+    }
+    free(diff);
 }
 
 /*
@@ -297,52 +416,43 @@ void pass3() {
  * it should print a short description of the error, and correct the bitmap.
  */
 void pass4() {
-    // encoding from the first data block
-
+    // both bitmaps are packed, bit (n - s_first_data_block) is block n
     char* bitmap = get_block_bitmap_in_partition();
+    __u32 size = get_block_bitmap_bytes();
     // bitmap obtained by walking through eht directory tree
-    char* true_bitmap = 
-        (char*)calloc((super_block.s_blocks_count + 1), sizeof(char));
+    char* true_bitmap = (char*)calloc(size, sizeof(char));
+    char* diff = (char*)malloc(size);
+    __u32 i;
+    __u32 first_block = super_block.s_first_data_block;
+    __u32 bits_num = super_block.s_blocks_count - first_block;
+
+    // superblock and GDT copies, bitmaps and inode tables are allocated,
+    // marked first so that files claiming them are caught as well
+    bitmap_or(true_bitmap, meta_block_bitmap, size);
+    dup_block_bitmap = (char*)calloc(size, sizeof(char));
+    start_dir_walk(ROOT_INODE_NUM);
     get_true_block_bitmap(true_bitmap, ROOT_INODE_NUM);
+    // the owners are only looked for when there is a duplicate
+    if (bitmap_find_next(dup_block_bitmap, 0, bits_num) < bits_num) {
+        report_duplicate_blocks();
+    }
+    free(dup_block_bitmap);
+    dup_block_bitmap = NULL;
 
-    __u32 i, j;
-    __u32 blocks_per_group = super_block.s_blocks_per_group;
-    __u32 group_num 
-        = (super_block.s_blocks_count + blocks_per_group - 1) / blocks_per_group;
-    __u32 skip_block_num = get_skip_block_num_in_group();
-
-    __u32 block_id = 1;
-    char alloc_bit;
+    // compare a block of bitmap at a time, then report the differences
     char found_error = 0;
-    for (i = 0; i < group_num; ++i) {
-        block_id += skip_block_num;
-        for (j = 0; j + skip_block_num < blocks_per_group; ++j) {
-            alloc_bit = get_block_alloc_bit(bitmap, block_id);
-            if (true_bitmap[block_id] != alloc_bit) {
-                found_error = 1;
-                printf("Block bitmap difference: %u\n", block_id);
-                fix_block_bitmap_in_partition(bitmap, block_id);
-            }
-            ++block_id;
-            if (block_id >= super_block.s_blocks_count) {
-                break;
-            }
-        }
+    for (i = 0; i < size; i += block_size) {
+        found_error |= block_kernels.bitmap_diff_block(bitmap + i, 
+                true_bitmap + i, diff + i);
     }
-
-    // check inode table block allocation
-    for (i = 0; i < group_num; ++i) {
-        struct ext2_group_desc group_desc = read_group_desc(i);
-        __u32 start_block_id = group_desc.bg_inode_table;
-        __u32 inode_block_per_group = get_group_inode_block_num();
-        for (j = 0; j < inode_block_per_group; ++j) {
-            block_id = start_block_id + j;
-            alloc_bit = get_block_alloc_bit(bitmap, block_id);
-            if (alloc_bit != 1) {
-                found_error = 1;
-                printf("Block bitmap difference: %u\n", block_id);
-                fix_block_bitmap_in_partition(bitmap, block_id);
-            }
+    if (found_error) {
+        found_error = 0;
+        __u32 bit = bitmap_find_next(diff, 0, bits_num);
+        while (bit < bits_num) {
+            found_error = 1;
+            report_block_bitmap_diff(bit + first_block);
+            fix_block_bitmap_in_partition(bitmap, bit + first_block);
+            bit = bitmap_find_next(diff, bit + 1, bits_num);
         }
     }
 
@@ -350,137 +460,69 @@ void pass4() {
         write_block_bitmap_in_partition(bitmap);
     }
     
-    free(bitmap);
+    // kept for reconcile_free_counts()
+    block_bitmap = bitmap;
     free(true_bitmap);
+    free(diff);
 }
 
 /*
  * bitmap obtained by walking through eht directory tree
+ * Every block in the inode's block map is marked, including the
+ * indirect pointer blocks. Directories are walked recursively, each
+ * inode only once, so a block marked twice is claimed twice and goes
+ * into dup_block_bitmap.
  */
 void get_true_block_bitmap(char* block_bitmap, __u32 inode_num) {
-    char dir_block[block_size];
-    struct ext2_dir_entry_2 entry;
+    char* dir_blocks;
+    char* dir_block;
+    DirEntryIter iter;
+    DirEntry entry;
+    BlockMapIter map;
+    BlockRun run;
     
-    struct ext2_inode inode = read_inode(inode_num);
-
-    // TODO assume symbolic name fits into 60 bytes
-    if (INODE_IS_LNK(&inode)) {  
-        return;
-    } else if (INODE_IS_REG(&inode)) {
-        get_file_block_bitmap(block_bitmap, &inode);
+    // inodes without blocks need not be read at all
+    if (inode_num == 0 || inode_num > inode_summary.inodes_count ||
+            inode_summary.blocks[inode_num] == 0) {
         return;
     }
-    
-    int i;
-    for (i = 0; i < EXT2_N_BLOCKS; ++i) {
-        __u32 block_id = inode.i_block[i];
-        if (block_id == 0) {
-            break;
-        }
-
-        block_bitmap[block_id] = 1;
-        read_block(block_id, block_size, dir_block);
+    struct ext2_inode inode = read_inode(inode_num);
+    int is_dir = INODE_IS_DIR(&inode);
+    dir_blocks = is_dir? (char*)malloc(DIR_READ_BATCH * block_size): NULL;
 
-        int offset = 0;
-        int len;
-        int count = 0;
-        while (offset < block_size) {
-            len = read_dir_entry_in_block(dir_block, offset, &entry);
-            if (len < 0) {
-                break;
-            } 
-            if (i != 0 || count >= 2) {
-                get_true_block_bitmap(block_bitmap, entry.inode);
+    __u32 i;
+    block_map_init(&map, &inode);
+    while (block_map_next(&map, &run)) {
+        for (i = 0; i < run.length; ++i) {
+            __u32 bit = run.physical + i - super_block.s_first_data_block;
+            if (bitmap_test_and_set(block_bitmap, bit)) {
+                bitmap_set(dup_block_bitmap, bit);
             }
-            offset += len;
-            ++count;
         }
-    }
-}
-
-/*
- * Get the given file's block allocation condition.
- * I assume that there is only indirect and double-indirect block
- */
-void get_file_block_bitmap(char* block_bitmap, struct ext2_inode* inode) {
-    int file_block_num = (inode->i_size + block_size - 1) / block_size;
-    int i;
-    if (file_block_num <= EXT2_NDIR_BLOCKS) {
-        for (i = 0; i < file_block_num; ++i) {
-            block_bitmap[inode->i_block[i]] = 1;
-        }
-    } else if (file_block_num <= INDIRECT_MAX_BLOCK) {
-        get_file_indirect_block_bitmap(block_bitmap, inode, file_block_num);
-    } else if (file_block_num <= DOUBLE_INDIRECT_MAX_BLOCK){ 
-        get_file_double_indirect_block_bitmap(
-                block_bitmap, inode, file_block_num);
-    } else { // TODO assume only doubly linked
-        printf("ooooooooops!!\n");
-    }
-}
-
-/*
- * If the file's size is more than DIRECT_MAX_BLOCK and not 
- * more than INDIRECT_MAX_BLOCK, we can store it using the 
- * 13rd i_block pointer, which is indirect block pointer
- */
-void get_file_indirect_block_bitmap(char* block_bitmap, 
-        struct ext2_inode* inode, __u32 file_block_num) {
-    int i;
-    for (i = 0; i < EXT2_NDIR_BLOCKS; ++i) {
-        block_bitmap[inode->i_block[i]] = 1;
-    }
-    char pointer_block[block_size];
-    int k = EXT2_IND_BLOCK;
-    block_bitmap[inode->i_block[k]] = 1;
-    read_block(inode->i_block[k], block_size, pointer_block);
-    for (i = 0; i < block_size; i += 4) {
-        block_bitmap[parse_bytes_to_decimal_u(pointer_block, i, 4)] = 1;
-        ++k;
-        if (k == file_block_num) {
-            return;
+        if (!is_dir || run.level != 0) {
+            continue;
         }
-    }
-}
+        for (i = 0; i < run.length; ++i) {
+            dir_block = dir_run_block(&run, i, dir_blocks);
 
-/*
- * If the file's size is more than INDIRECT_MAX_BLOCK, 
- * It is stored using the 14th i_block pointer, 
- * which is double indirect block pointer
- */
-void get_file_double_indirect_block_bitmap(char* block_bitmap, 
-        struct ext2_inode* inode, __u32 file_block_num) {
-    // read first 12 direct blocks
-    int i, j;
-    for (i = 0; i < EXT2_NDIR_BLOCKS; ++i) {
-        block_bitmap[inode->i_block[i]] = 1;
-    }
-    char pointer_block_lev1[block_size];
-    char pointer_block_lev2[block_size];
-    // read the 13rd indirect block
-    block_bitmap[inode->i_block[EXT2_IND_BLOCK]] = 1;
-    read_block(inode->i_block[EXT2_IND_BLOCK], block_size, pointer_block_lev1);
-    int k = EXT2_NDIR_BLOCKS;
-    for (i = 0; i < block_size; i += 4) {
-        block_bitmap[parse_bytes_to_decimal_u(pointer_block_lev1, i, 4)] = 1;
-        ++k;
-    }
-
-    // read the 14th double indirect block
-    block_bitmap[inode->i_block[EXT2_DIND_BLOCK]] = 1;
-    read_block(inode->i_block[EXT2_DIND_BLOCK], block_size, pointer_block_lev1);
-    for (i = 0; i < block_size; i += 4) {
-        __u32 indirect_block_id = parse_bytes_to_decimal_u(pointer_block_lev1, i, 4);
-        block_bitmap[indirect_block_id] = 1;
-        read_block(indirect_block_id, block_size, pointer_block_lev2);
-        for (j = 0; j < block_size; j += 4) {
-            block_bitmap[parse_bytes_to_decimal_u(pointer_block_lev2, j, 4)] = 1;
-            ++k;
-            if (k == file_block_num) {
-                return;
+            dir_iter_init(&iter, dir_block);
+            while (dir_iter_next(&iter, &entry)) {
+                if (run.logical + i == 0 && iter.index < 2) {
+                    continue;
+                }
+                // hard links must not claim the blocks again
+                if (visit_dir(entry.inode)) {
+                    continue;
+                }
+                get_true_block_bitmap(block_bitmap, entry.inode);
             }
         }
     }
+    if (map.bad_num > 0) {
+        report(REPORT_BAD_POINTERS, inode_num, map.bad_num, 0);
+    }
+    block_map_free(&map);
+    free(dir_blocks);
 }
 
 /*
@@ -494,27 +536,52 @@ int correct_one_partition(int partition_num) {
         return 0;
     }
 
-    // read super block
+    report_begin_partition(partition_num);
+    // read super block, falling back to a backup copy if it is damaged
     read_super_block();
+    if (check_super_copies || !super_block_sane(&super_block)) {
+        if (check_super_backups() == -1) {
+            report_end_partition();
+            return 0;
+        }
+    }
+    // hot loops specialized for this partition's block size
+    select_block_kernels();
 
-    // read the group descriptor block
-    group_desc_block = (char*)malloc(block_size * sizeof(char));
-    read_group_desc_block(group_desc_block);
+    // read and decode the group descriptor table
+    read_group_desc_table();
+    build_group_layout();
+    // scan the inode tables of the allocated inodes once
+    inode_bitmap = get_inode_bitmap_in_partition();
+    build_inode_summary();
 
     // read the root directory's inode
     /*struct ext2_inode root_inode = read_inode(ROOT_INODE_NUM); */
 
-    char* inode_links_count = 
-        (char*)calloc((super_block.s_inodes_count + 1), sizeof(char));
+    start_dir_walk(ROOT_INODE_NUM);
     pass1(ROOT_INODE_NUM, ROOT_INODE_NUM);
     pass2();
     pass3();
+    check_inode_bitmap();
     pass4();
+    reconcile_free_counts();
     /*struct ext2_inode inode = read_inode(2010);*/
     /*printf("size: %d\n", inode.i_size);*/
 
-    free(inode_links_count);
-    free(group_desc_block);
+    free_inode_summary();
+    free(inode_bitmap);
+    inode_bitmap = NULL;
+    free(block_bitmap);
+    block_bitmap = NULL;
+    free(used_inode_bitmap);
+    used_inode_bitmap = NULL;
+    free(dir_links_count);
+    dir_links_count = NULL;
+    free_group_layout();
+    free_group_desc_table();
+    free(visited_dir_bitmap);
+    visited_dir_bitmap = NULL;
+    report_end_partition();
 }
 
 /*
@@ -535,26 +602,40 @@ int correct_partition(int partition_num) {
     }
 }
 
-inline void print_dir_entry_error(__u32 inode_num, 
-        struct ext2_dir_entry_2* entry) {
-    printf("dir entry incorrect, parent inode_num: %u, subdir_name: %s,\
-            inode: %u\n", inode_num, entry->name, entry->inode);
+inline void print_dir_entry_error(__u32 inode_num, DirEntry* entry) {
+    report_entry(REPORT_DIR_ENTRY, inode_num, entry);
+}
+
+inline void print_dir_loop_error(__u32 inode_num, DirEntry* entry) {
+    report_entry(REPORT_DIR_LOOP, inode_num, entry);
 }
 
 /*
- * When checking the block bitmap, skip the first few blocks
- * of each group that contains superblock, group descriptor,
- * block bitmap, inode bitmap and inode table, they should 
- * always be 1.
+ * Start a new walk over the directory tree from the given directory.
+ * Each walk expands every directory at most once, so a corrupted
+ * entry pointing back to an ancestor, or a directory linked twice,
+ * cannot make the walk recurse forever or repeat a subtree.
  */
-inline __u32 get_skip_block_num_in_group() {
-    // superblock and group descriptor are both 1 block
-    __u32 skip_block_num = 2;
-    // group block bitmap
-    skip_block_num += get_group_block_bitmap_block_num();
-    // group inode bitmap
-    skip_block_num += get_group_inode_bitmap_block_num();
-    // group inode table
-    skip_block_num += get_group_inode_block_num();
-    return skip_block_num;
+void start_dir_walk(__u32 root_inode_num) {
+    __u64 bytes = bitmap_bytes((__u64)super_block.s_inodes_count + 1);
+    if (visited_dir_bitmap == NULL) {
+        visited_dir_bitmap = bitmap_alloc((__u64)super_block.s_inodes_count + 1);
+    } else {
+        memset(visited_dir_bitmap, 0, bytes);
+    }
+    visit_dir(root_inode_num);
 }
+
+/*
+ * Mark the directory as visited by the current walk. pass4 marks
+ * files as well, so a hard linked file is walked only once.
+ * Return 1 if it was visited before (or is not a valid inode number),
+ * in which case it must not be expanded again.
+ */
+int visit_dir(__u32 inode_num) {
+    if (inode_num == 0 || inode_num > super_block.s_inodes_count) {
+        return 1;
+    }
+    return bitmap_test_and_set(visited_dir_bitmap, inode_num);
+}
+
@@ -1,11 +1,8 @@
-// ext2_dir_entry_2's entry length excluding name length
-#define DIR_ENTRY_PREFIX_LEN 8
-
 // the first entry is '.', its length is 12
 #define FIRST_ENTRY_LEN 12
 
-#define INDIRECT_MAX_BLOCK 268
-#define DOUBLE_INDIRECT_MAX_BLOCK 65549
+// link counts are compared this many inodes at a time
+#define LINKS_COMPARE_CHUNK 64
 
 //#define CORRECT_DEBUG
 
@@ -14,15 +11,23 @@ char* lost_found_dir_name = "lost+found";
 
 extern int read_partition_info(int);
 extern int read_super_block();
-extern void read_group_desc_block(char*);
+extern void read_group_desc_table();
+extern void free_group_desc_table();
+extern void build_inode_summary();
+extern void free_inode_summary();
 extern struct ext2_group_desc read_group_desc(__u32);
 extern struct ext2_inode read_inode(__u32);
-extern int read_dir_entry_in_block(char*, int, struct ext2_dir_entry_2*);
+extern void dir_iter_init(DirEntryIter*, char*);
+extern int dir_iter_next(DirEntryIter*, DirEntry*);
+extern char* dir_run_block(BlockRun*, __u32, char*);
 extern char* get_inode_bitmap_in_partition();
 extern char get_inode_alloc_bit(char*, __u32);
+extern __u32 next_alloc_inode(char*, __u32);
 extern int search_dir_entry(struct ext2_inode*, char*, struct ext2_dir_entry_2*);
 extern void write_inode(__u32, __u32);
 extern char* get_block_bitmap_in_partition();
+extern __u32 get_block_bitmap_bytes();
+extern __u32 get_block_group_num();
 extern char get_block_alloc_bit(char*, __u32);
 extern __u32 get_inode_bitmap_block_num();
 extern __u32 get_block_bitmap_block_num();
@@ -32,15 +37,37 @@ extern __u32 get_group_inode_block_num();
 extern __u32 get_group_inode_bitmap_block_num();
 extern void fix_block_bitmap_in_partition(char*, __u32);
 extern void write_block_bitmap_in_partition(char*);
+extern void block_map_init(BlockMapIter*, struct ext2_inode*);
+extern int block_map_next(BlockMapIter*, BlockRun*);
+extern int block_map_next_data(BlockMapIter*, BlockRun*);
+extern void block_map_free(BlockMapIter*);
+extern char* bitmap_alloc(__u64);
+extern __u64 bitmap_bytes(__u64);
+extern char bitmap_test_and_set(char*, __u32);
+extern char bitmap_test(char*, __u32);
+extern void bitmap_set(char*, __u32);
+extern __u32 bitmap_find_next(char*, __u32, __u32);
+extern void select_block_kernels();
+extern void bitmap_or(char*, char*, __u32);
+extern int check_super_backups();
+extern void reconcile_free_counts();
+extern __u32 get_inode_bitmap_bytes();
+extern void write_inode_bitmap_in_partition(char*);
+extern void add_to_inode_summary(__u32, struct ext2_inode*);
+extern void bitmap_clear(char*, __u32);
+extern void report_duplicate_blocks();
+extern int super_block_sane(struct ext2_super_block*);
+extern void build_group_layout();
+extern void free_group_layout();
 
-inline __u32 get_skip_block_num_in_group();
-inline void print_dir_entry_error(__u32, struct ext2_dir_entry_2*);
+inline void print_dir_entry_error(__u32, DirEntry*);
+inline void print_dir_loop_error(__u32, DirEntry*);
+void start_dir_walk(__u32);
+int visit_dir(__u32);
 void pass1_corrector(char*, __u32, __u32, __u32);
-int add_to_lost_found(char*, __u32);
-void directory_traversor(char*, __u32);
+int add_to_lost_found(__u16*, __u32);
+void directory_traversor(__u16*, __u32);
 struct ext2_dir_entry_2 create_new_entry(__u32);
 void write_new_entry(struct ext2_dir_entry_2*, char*, __u32, __u32);
 void get_true_block_bitmap(char*, __u32);
-void get_file_block_bitmap(char*, struct ext2_inode*);
-void get_file_indirect_block_bitmap(char*, struct ext2_inode*, __u32);
-void get_file_double_indirect_block_bitmap(char*, struct ext2_inode*, __u32);
+void check_inode_bitmap();
@@ -1,12 +1,13 @@
 #include "common.h"
 #include "util.h"
+#include "readPlan.h"
 
 #define bits_per_byte 8
 /*#define DEBUG*/
 
 extern struct ext2_group_desc read_group_desc(__u32 id);
 
-inline __u32 get_block_group_num();
+__u32 get_block_group_num();
 __u32 get_group_block_bitmap_block_num();
 
 /*
@@ -16,26 +17,51 @@ void get_block_bitmap_in_group(char* block_bitmap,
         __u32 group_id, __u32 block_num) {
     // get group descriptor
     struct ext2_group_desc group_desc = read_group_desc(group_id);
-    __u32 start_block = group_desc.bg_block_bitmap;
-    __u32 i;
-    for (i = 0; i < block_num; ++i) {
-        read_block(start_block + i, block_size, block_bitmap + i * block_size);
-    }
+    read_blocks(group_desc.bg_block_bitmap, block_num, block_bitmap);
+}
+
+/*
+ * Return the size in bytes of the packed block bitmap.
+ * Each group holds s_blocks_per_group bits, the groups are packed one 
+ * after another, so bit (n - s_first_data_block) is block n. The size 
+ * is rounded up to whole blocks for the bitmap diff kernel.
+ */
+__u32 get_block_bitmap_bytes() {
+    __u32 group_bytes = super_block.s_blocks_per_group / bits_per_byte;
+    __u32 size = get_block_group_num() * group_bytes;
+    return (size + block_size - 1) / block_size * block_size;
 }
 
 /*
- * Load all block bitmap in the partition
+ * Load all block bitmap in the partition, packed as described in 
+ * get_block_bitmap_bytes()
+ * The bitmaps of BITMAP_READ_GROUPS groups are planned together, so
+ * bitmaps lying next to each other are read with one request.
  */
 char* get_block_bitmap_in_partition() {
     __u32 group_num = get_block_group_num();
     __u32 block_num = get_group_block_bitmap_block_num();
-    __u32 size = group_num * block_num * block_size;
-    char* bitmap = (char*)malloc(size * sizeof(char));
-    __u32 i;
-    for (i = 0; i < group_num; ++i) {
-        __u32 offset = i * block_num * block_size;
-        get_block_bitmap_in_group(bitmap + offset, i, block_num);
+    __u32 group_bytes = super_block.s_blocks_per_group / bits_per_byte;
+    char* bitmap = (char*)calloc(get_block_bitmap_bytes(), sizeof(char));
+    char* group_bitmaps = 
+        (char*)malloc(BITMAP_READ_GROUPS * block_num * block_size);
+    ReadPlan plan;
+    __u32 i, j;
+    read_plan_init(&plan, read_gap_blocks);
+    for (i = 0; i < group_num; i += BITMAP_READ_GROUPS) {
+        for (j = i; j < group_num && j < i + BITMAP_READ_GROUPS; ++j) {
+            read_plan_add_range(&plan, read_group_desc(j).bg_block_bitmap, 
+                    block_num, group_bitmaps + (j - i) * block_num * block_size);
+        }
+        read_plan_execute(&plan);
+        for (j = i; j < group_num && j < i + BITMAP_READ_GROUPS; ++j) {
+            memcpy(bitmap + j * group_bytes, 
+                    group_bitmaps + (j - i) * block_num * block_size, 
+                    group_bytes);
+        }
     }
+    read_plan_free(&plan);
+    free(group_bitmaps);
     return bitmap;
 }
 
@@ -52,18 +78,29 @@ void write_block_bitmap_in_group(char* block_bitmap,
         write_block(start_block + i, block_size, block_bitmap + i * block_size);
     }
 }
+
 /*
  * Write partition's blcok bitmap into disk image 
+ * Only the groups whose bits changed are written. The bytes after the 
+ * group's bits in its bitmap blocks are kept as they are on disk.
  */
 void write_block_bitmap_in_partition(char* bitmap) {
     __u32 group_num = get_block_group_num();
     __u32 block_num = get_group_block_bitmap_block_num();
+    __u32 group_bytes = super_block.s_blocks_per_group / bits_per_byte;
+    char* group_bitmap = (char*)malloc(block_num * block_size);
 
-    int i;
+    __u32 i;
     for (i = 0; i < group_num; ++i) {
-        __u32 offset = i * block_num * block_size;
-        write_block_bitmap_in_group(bitmap + offset, i, block_num);
+        get_block_bitmap_in_group(group_bitmap, i, block_num);
+        if (memcmp(group_bitmap, bitmap + i * group_bytes, 
+                    group_bytes) == 0) {
+            continue;
+        }
+        memcpy(group_bitmap, bitmap + i * group_bytes, group_bytes);
+        write_block_bitmap_in_group(group_bitmap, i, block_num);
     }
+    free(group_bitmap);
 }
 
 /*
@@ -74,8 +111,9 @@ void write_block_bitmap_in_partition(char* bitmap) {
  *     block_id: the block id that is not correct in bitmap
  */
 void fix_block_bitmap_in_partition(char* bitmap, __u32 block_id) {
-    __u32 index = (block_id - 1) / bits_per_byte;
-    __u32 offset = (block_id - 1) % bits_per_byte;
+    block_id -= super_block.s_first_data_block;
+    __u32 index = block_id / bits_per_byte;
+    __u32 offset = block_id % bits_per_byte;
 
     // flip the bit
     bitmap[index] = bitmap[index] ^ (1 << offset);
@@ -84,14 +122,16 @@ void fix_block_bitmap_in_partition(char* bitmap, __u32 block_id) {
 /*
  * Return the block's allocate bit in the block bitmap
  * NOTE: 
+ * the bitmap starts at the first data block, so with 1KB blocks
  * block 0 is NOT represented in the block bitmap
  * block 1 is store in the LEAST significant bit of byte 0
  * block 8 is store in the MOST significant bit of byte 0
  */
 char get_block_alloc_bit(char* block_bitmap, __u32 block_id) {
     /*block_id = block_id % super_block.s_blocks_per_group;*/
-    __u32 index = (block_id - 1) / bits_per_byte;
-    __u32 offset = (block_id - 1) % bits_per_byte;
+    block_id -= super_block.s_first_data_block;
+    __u32 index = block_id / bits_per_byte;
+    __u32 offset = block_id % bits_per_byte;
 #ifdef DEBUG
     printf("block index: %d, offset: %u\n", index, offset);
 #endif
@@ -101,16 +141,21 @@ char get_block_alloc_bit(char* block_bitmap, __u32 block_id) {
 
 __u32 get_block_group_id(__u32 block_id) {
     /*return block_id  / super_block.s_blocks_per_group;*/
-    return (block_id - 1) / super_block.s_blocks_per_group;
+    return (block_id - super_block.s_first_data_block) / 
+        super_block.s_blocks_per_group;
 }
 
 __u32 get_block_bitmap_block_num() {
     return get_group_block_bitmap_block_num() * get_block_group_num();
 }
 
-inline __u32 get_block_group_num() {
+/*
+ * Groups start at the first data block, so block 0 of a 1KB block 
+ * filesystem does not belong to any group.
+ */
+__u32 get_block_group_num() {
     __u32 blocks_per_group = super_block.s_blocks_per_group;
-    return (super_block.s_blocks_count + 
+    return (super_block.s_blocks_count - super_block.s_first_data_block +
             blocks_per_group - 1) / blocks_per_group;
 }
 
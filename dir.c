@@ -2,26 +2,101 @@
 #include "util.h"
 
 extern struct ext2_inode read_inode(__u32);
+extern void block_map_init(BlockMapIter*, struct ext2_inode*);
+extern int block_map_next_data(BlockMapIter*, BlockRun*);
+extern void block_map_free(BlockMapIter*);
 
 inline int extract_entry_name(char*);
 inline void parse_name(struct ext2_inode* , char*);
 
 /*
- * read a inode entry's directory entry start from a offset
- * return the length of the directory entry.
+ * Start walking the entries of a directory block.
  */
-int read_dir_entry_in_block(char* dir_block, int offset, 
-        struct ext2_dir_entry_2* dir_entry) {
-    dir_entry->inode = parse_bytes_to_decimal_u(dir_block, offset, 4);    
-    if (dir_entry->inode == 0) {
-        return -1;
+void dir_iter_init(DirEntryIter* iter, char* dir_block) {
+    iter->dir_block = dir_block;
+    iter->offset = 0;
+    iter->index = -1;
+}
+
+/*
+ * Move to the next used entry of a block of the given size, starting
+ * at *offset. The entry is a view into the block, the name is not 
+ * copied.
+ * Return 1 if an entry is found, 0 at the end of the block.
+ * Unused entries (inode 0) are skipped. A rec_len that is too short
+ * or runs past the end of the block stops the walk.
+ */
+static ALWAYS_INLINE int dir_entry_next_sized(char* dir_block, 
+        __u32* offset, DirEntry* entry, __u32 size) {
+    unsigned char* p;
+    while (*offset + DIR_ENTRY_PREFIX_LEN <= size) {
+        p = (unsigned char*)dir_block + *offset;
+        entry->inode = GET_LE32(p);
+        entry->rec_len = GET_LE16(p + 4);
+        entry->name_len = p[6];
+        entry->file_type = p[7];
+        entry->name = (char*)p + DIR_ENTRY_PREFIX_LEN;
+        entry->offset = *offset;
+        if (entry->rec_len < DIR_ENTRY_PREFIX_LEN + entry->name_len ||
+                *offset + entry->rec_len > size) {
+            *offset = size;
+            return 0;
+        }
+        *offset += entry->rec_len;
+        if (entry->inode != 0) {
+            return 1;
+        }
     }
-    dir_entry->rec_len = parse_bytes_to_decimal_u(dir_block, offset + 4, 2);
-    dir_entry->name_len = parse_bytes_to_decimal_u(dir_block, offset + 6, 1);
-    dir_entry->file_type = parse_bytes_to_decimal_u(dir_block, offset + 7, 1);
-    strncpy(dir_entry->name, dir_block + offset + 8, dir_entry->name_len);
-    dir_entry->name[dir_entry->name_len] = '\0';
-    return dir_entry->rec_len;
+    return 0;
+}
+
+#define dir_entry_next_WRAPPER(suffix, size) \
+    static int dir_entry_next_##suffix(char* dir_block, __u32* offset, \
+            DirEntry* entry) { \
+        return dir_entry_next_sized(dir_block, offset, entry, size); \
+    }
+
+DEFINE_BLOCK_KERNELS(DirEntryNextFunc, dir_entry_next, 
+        select_dir_entry_next)
+
+/*
+ * Move to the next used entry of the block.
+ * Return 1 if an entry is found, 0 at the end of the block.
+ */
+int dir_iter_next(DirEntryIter* iter, DirEntry* entry) {
+    if (block_kernels.dir_entry_next(iter->dir_block, 
+                &iter->offset, entry)) {
+        ++iter->index;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Return block i of a directory run. Blocks are read DIR_READ_BATCH at 
+ * a time into "blocks" (DIR_READ_BATCH * block_size bytes), so i must
+ * go from 0 up one by one.
+ */
+char* dir_run_block(BlockRun* run, __u32 i, char* blocks) {
+    __u32 batch_offset = i % DIR_READ_BATCH;
+    __u32 num;
+    if (batch_offset == 0) {
+        num = run->length - i;
+        if (num > DIR_READ_BATCH) {
+            num = DIR_READ_BATCH;
+        }
+        read_blocks(run->physical + i, num, blocks);
+    }
+    return blocks + batch_offset * block_size;
+}
+
+/*
+ * Compare the entry's name with a name of known length.
+ * Names of different length never reach memcmp.
+ */
+int dir_entry_name_equals(DirEntry* entry, char* name, int name_len) {
+    return entry->name_len == name_len && 
+        memcmp(entry->name, name, name_len) == 0;
 }
 
 /*
@@ -29,26 +104,24 @@ int read_dir_entry_in_block(char* dir_block, int offset,
  */
 void print_entry_name_in_dir(struct ext2_inode* inode) {
     char dir_block[block_size];
-    int i;
-    for (i = 0; i < EXT2_N_BLOCKS; ++i) {
-        __u32 block_id = inode->i_block[i];
-        if (block_id == 0) {
-            break;
-        }
-        read_block(block_id, block_size, dir_block);
+    DirEntryIter iter;
+    DirEntry entry;
+    BlockMapIter map;
+    BlockRun run;
+    __u32 i;
+    block_map_init(&map, inode);
+    while (block_map_next_data(&map, &run)) {
+        for (i = 0; i < run.length; ++i) {
+            read_block(run.physical + i, block_size, dir_block);
 
-        struct ext2_dir_entry_2 entry;
-        int offset = 0;
-        int len;
-        while (offset < block_size) {
-            len = read_dir_entry_in_block(dir_block, offset, &entry);
-            if (len < 0) {
-                break;
+            dir_iter_init(&iter, dir_block);
+            while (dir_iter_next(&iter, &entry)) {
+                printf("inode number: %d, %.*s\n", 
+                        entry.inode, entry.name_len, entry.name);
             }
-            offset += len;
-            printf("inode number: %d, %s\n", entry.inode, entry.name);
         }
     }
+    block_map_free(&map);
 }
 
 /*
@@ -65,33 +138,37 @@ void print_entry_name_in_dir(struct ext2_inode* inode) {
 int search_dir_entry(struct ext2_inode* inode, char* name, 
         struct ext2_dir_entry_2* dir_entry) {
     char dir_block[block_size];
+    int name_len = strlen(name);
+    DirEntryIter iter;
+    DirEntry entry;
+    BlockMapIter map;
+    BlockRun run;
+    int found = -1;
 
-    int i;
-    for (i = 0; i < EXT2_N_BLOCKS; ++i) {
-        __u32 block_id = inode->i_block[i];
-        if (block_id == 0) {
-            break;
-        }
-        read_block(block_id, block_size, dir_block);
+    __u32 i;
+    block_map_init(&map, inode);
+    while (found < 0 && block_map_next_data(&map, &run)) {
+        for (i = 0; found < 0 && i < run.length; ++i) {
+            read_block(run.physical + i, block_size, dir_block);
 
-        struct ext2_dir_entry_2 entry;
-        int offset = 0;
-        int len;
-        int found = -1;
-        while (offset < block_size) {
-            len = read_dir_entry_in_block(dir_block, offset, &entry);
-            if (len < 0) {
-                break;
+            dir_iter_init(&iter, dir_block);
+            while (dir_iter_next(&iter, &entry)) {
+                if (dir_entry_name_equals(&entry, name, name_len)) {
+                    // only the matching entry is copied out
+                    dir_entry->inode = entry.inode;
+                    dir_entry->rec_len = entry.rec_len;
+                    dir_entry->name_len = entry.name_len;
+                    dir_entry->file_type = entry.file_type;
+                    memcpy(dir_entry->name, entry.name, entry.name_len);
+                    dir_entry->name[entry.name_len] = '\0';
+                    found = 1;
+                    break;
+                }
             }
-            if (strcmp(entry.name, name) == 0) {
-                found = 1;
-                memcpy(dir_entry, &entry, sizeof(struct ext2_inode));
-                break;
-            }
-            offset += len;
         }
-        return found;
     }
+    block_map_free(&map);
+    return found;
 }
 
 /*
@@ -141,7 +218,8 @@ int search_dir_entry_r(struct ext2_inode* cur_inode, char* path,
  */
 int get_dir_name(__u32 inode_num, char* name) {
     struct ext2_inode inode = read_inode(inode_num);
-    struct ext2_dir_entry_2 entry;
+    DirEntryIter iter;
+    DirEntry entry;
     char dir_block[block_size];
     if (INODE_IS_LNK(&inode)) {
         parse_name(&inode, name);
@@ -149,8 +227,12 @@ int get_dir_name(__u32 inode_num, char* name) {
         // read the first direct datablock pointed by inode
         __u32 block_id = inode.i_block[0];
         read_block(block_id, block_size, dir_block);
-        read_dir_entry_in_block(dir_block, 0, &entry); 
-        strncpy(name, entry.name, entry.name_len);
+        dir_iter_init(&iter, dir_block);
+        if (!dir_iter_next(&iter, &entry)) {
+            name[0] = '\0';
+            return -1;
+        }
+        memcpy(name, entry.name, entry.name_len);
         name[entry.name_len] = '\0';
     }
     return 0;
@@ -0,0 +1,90 @@
+/*
+ * Attribute multiply-claimed blocks to their owners.
+ *
+ * pass4 notices a block claimed twice for the price of one extra 
+ * bitset (dup_block_bitmap). Only when that bitset is not empty are 
+ * the allocated inodes' block maps walked again, to find every inode
+ * claiming one of those blocks, like e2fsck's pass1b.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+#include "report.h"
+
+extern struct ext2_inode read_inode(__u32);
+extern __u32 next_alloc_inode(char*, __u32);
+extern void block_map_init(BlockMapIter*, struct ext2_inode*);
+extern int block_map_next(BlockMapIter*, BlockRun*);
+extern void block_map_free(BlockMapIter*);
+extern char bitmap_test(char* bitmap, __u32 bit);
+
+static int compare_claims(const void* a, const void* b) {
+    const BlockClaim* x = (const BlockClaim*)a;
+    const BlockClaim* y = (const BlockClaim*)b;
+    if (x->block != y->block) {
+        return x->block < y->block? -1: 1;
+    }
+    return x->inode_num < y->inode_num? -1: x->inode_num > y->inode_num;
+}
+
+/*
+ * Append the inode's claims on blocks in dup_block_bitmap
+ */
+static void collect_claims(__u32 inode_num, BlockClaim** claims, 
+        __u32* num, __u32* capacity) {
+    struct ext2_inode inode = read_inode(inode_num);
+    BlockMapIter map;
+    BlockRun run;
+    __u32 i;
+    block_map_init(&map, &inode);
+    while (block_map_next(&map, &run)) {
+        for (i = 0; i < run.length; ++i) {
+            __u32 block = run.physical + i;
+            if (!bitmap_test(dup_block_bitmap, 
+                        block - super_block.s_first_data_block)) {
+                continue;
+            }
+            if (*num == *capacity) {
+                *capacity = *capacity == 0? 64: *capacity * 2;
+                *claims = (BlockClaim*)realloc(*claims, 
+                        *capacity * sizeof(BlockClaim));
+            }
+            (*claims)[*num].block = block;
+            (*claims)[*num].inode_num = inode_num;
+            ++*num;
+        }
+    }
+    block_map_free(&map);
+}
+
+/*
+ * Report every multiply-claimed block with the inodes claiming it,
+ * sorted by block. Metadata blocks are also reported as claimed by 
+ * the filesystem itself (inode 0).
+ */
+void report_duplicate_blocks() {
+    BlockClaim* claims = NULL;
+    __u32 num = 0, capacity = 0;
+    __u32 i, j;
+
+    for (i = next_alloc_inode(inode_bitmap, 1); i != 0; 
+            i = next_alloc_inode(inode_bitmap, i + 1)) {
+        if (inode_summary.blocks[i] != 0) {
+            collect_claims(i, &claims, &num, &capacity);
+        }
+    }
+    qsort(claims, num, sizeof(BlockClaim), compare_claims);
+
+    for (i = 0; i < num; i = j) {
+        __u32 block = claims[i].block;
+        if (bitmap_test(meta_block_bitmap, 
+                    block - super_block.s_first_data_block)) {
+            report(REPORT_DUP_BLOCK, block, 0, 0);
+        }
+        for (j = i; j < num && claims[j].block == block; ++j) {
+            report(REPORT_DUP_BLOCK, block, claims[j].inode_num, 0);
+        }
+    }
+    free(claims);
+}
@@ -0,0 +1,133 @@
+/*
+ * Reconcile the free counts with the bitmaps.
+ *
+ * After the bitmaps are fixed, the free block and inode counts of 
+ * every group descriptor and of the superblock, and the directory 
+ * count of every group, are recomputed: the bitmaps are counted a 
+ * 64 bits word at a time with popcount, directories come from the 
+ * inode summary. The GDT and the superblock are then written back 
+ * once, only if anything changed.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+#include "util.h"
+#include "report.h"
+
+extern __u32 get_block_group_num();
+extern __u32 get_group_desc_block_num();
+extern __u32 bitmap_count(char* bitmap, __u32 start, __u32 end);
+extern __u32 bitmap_find_next(char* bitmap, __u32 start, __u32 end);
+
+/*
+ * Count the directories among the allocated inodes of the group
+ */
+static __u32 count_group_dirs(__u32 group_id) {
+    __u32 first_bit = group_id * super_block.s_inodes_per_group;
+    __u32 end_bit = first_bit + super_block.s_inodes_per_group;
+    __u32 count = 0;
+    __u32 bit = bitmap_find_next(inode_bitmap, first_bit, end_bit);
+    while (bit < end_bit) {
+        if (MODE_IS_DIR(inode_summary.mode[bit + 1])) {
+            ++count;
+        }
+        bit = bitmap_find_next(inode_bitmap, bit + 1, end_bit);
+    }
+    return count;
+}
+
+/*
+ * Store a 16 bits count into the raw descriptor if it differs.
+ * Return 1 if it changed.
+ */
+static int update_count(unsigned char* field, __u32 count, 
+        __u32 group_id, ReportKind kind) {
+    __u32 old = GET_LE16(field);
+    if (old == count) {
+        return 0;
+    }
+    report(kind, group_id, old, count);
+    field[0] = count & 0xFF;
+    field[1] = (count >> 8) & 0xFF;
+    return 1;
+}
+
+/*
+ * Store a 32 bits count into the raw superblock if it differs.
+ * Return 1 if it changed.
+ */
+static int update_super_count(unsigned char* field, __u32 count, 
+        ReportKind kind) {
+    __u32 old = GET_LE32(field);
+    if (old == count) {
+        return 0;
+    }
+    report(kind, 0, old, count);
+    field[0] = count & 0xFF;
+    field[1] = (count >> 8) & 0xFF;
+    field[2] = (count >> 16) & 0xFF;
+    field[3] = (count >> 24) & 0xFF;
+    return 1;
+}
+
+/*
+ * Recompute the free counts from block_bitmap and inode_bitmap and 
+ * write back what is stale.
+ * Must be called after the bitmaps are fixed.
+ */
+void reconcile_free_counts() {
+    __u32 group_num = get_block_group_num();
+    __u32 gdt_num = get_group_desc_block_num();
+    __u32 blocks_per_group = super_block.s_blocks_per_group;
+    __u32 inodes_per_group = super_block.s_inodes_per_group;
+    __u32 bits_num = super_block.s_blocks_count - 
+        super_block.s_first_data_block;
+    unsigned char* gdt = (unsigned char*)malloc(gdt_num * block_size);
+    unsigned char contents[SUPER_BLOCK_SIZE];
+    __u32 free_blocks = 0, free_inodes = 0;
+    int gdt_changed = 0;
+
+    read_blocks(super_block.s_first_data_block + 1, gdt_num, gdt);
+    __u32 i;
+    for (i = 0; i < group_num; ++i) {
+        unsigned char* desc = gdt + i * GROUP_DESC_SIZE;
+        __u32 start = i * blocks_per_group;
+        __u32 end = start + blocks_per_group;
+        if (end > bits_num) {
+            end = bits_num;
+        }
+        __u32 group_free_blocks = end - start - 
+            bitmap_count(block_bitmap, start, end);
+        __u32 group_free_inodes = inodes_per_group - 
+            bitmap_count(inode_bitmap, i * inodes_per_group, 
+                    (i + 1) * inodes_per_group);
+        __u32 dirs = count_group_dirs(i);
+
+        gdt_changed |= update_count(desc + 12, group_free_blocks, i, 
+                REPORT_GROUP_FREE_BLOCKS);
+        gdt_changed |= update_count(desc + 14, group_free_inodes, i, 
+                REPORT_GROUP_FREE_INODES);
+        gdt_changed |= update_count(desc + 16, dirs, i, REPORT_GROUP_DIRS);
+        group_descs[i].bg_free_blocks_count = group_free_blocks;
+        group_descs[i].bg_free_inodes_count = group_free_inodes;
+        group_descs[i].bg_used_dirs_count = dirs;
+        free_blocks += group_free_blocks;
+        free_inodes += group_free_inodes;
+    }
+    if (gdt_changed) {
+        write_blocks(super_block.s_first_data_block + 1, gdt_num, gdt);
+    }
+    free(gdt);
+
+    // the superblock is 1024 bytes into the partition
+    read_block(1, SUPER_BLOCK_SIZE, contents);
+    if (update_super_count(contents + 12, free_blocks, 
+                REPORT_SUPER_FREE_BLOCKS) |
+            update_super_count(contents + 16, free_inodes, 
+                REPORT_SUPER_FREE_INODES)) {
+        write_block(1, SUPER_BLOCK_SIZE, (char*)contents);
+    }
+    super_block.s_free_blocks_count = free_blocks;
+    super_block.s_free_inodes_count = free_inodes;
+}
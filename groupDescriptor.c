@@ -1,6 +1,11 @@
 /*
  * Fuctions to read group descriptors
  *
+ * The group descriptor table starts in the block following the 
+ * superblock and takes as many blocks as the groups need. It is read 
+ * once per partition and decoded into the group_descs array, which 
+ * every pass uses afterwards.
+ *
  * Author: Xiaoxiang Wu
  * AndrewID: xiaoxiaw
  */
@@ -8,32 +13,63 @@
 #include "common.h"
 #include "util.h"
 
+extern __u32 get_block_group_num();
+
+/*
+ * Return how many blocks the group descriptor table occupies
+ */
+__u32 get_group_desc_block_num() {
+    __u32 bytes = get_block_group_num() * GROUP_DESC_SIZE;
+    return (bytes + block_size - 1) / block_size;
+}
+
+/*
+ * Decode one 32 bytes group descriptor
+ */
+void parse_group_desc(unsigned char* contents, 
+        struct ext2_group_desc* group_desc) {
+    group_desc->bg_block_bitmap = GET_LE32(contents);
+    group_desc->bg_inode_bitmap = GET_LE32(contents + 4);
+    group_desc->bg_inode_table = GET_LE32(contents + 8);
+    group_desc->bg_free_blocks_count = GET_LE16(contents + 12);
+    group_desc->bg_free_inodes_count = GET_LE16(contents + 14);
+    group_desc->bg_used_dirs_count = GET_LE16(contents + 16);
+}
+
 /*
- * second block of the partiion is group descriptors block
+ * Read the whole group descriptor table, which follows the superblock, 
+ * and decode it into group_descs.
  */
-void read_group_desc_block(char* contents) {
-    read_block(2, block_size, contents);
+void read_group_desc_table() {
+    __u32 i;
+    __u32 block_num = get_group_desc_block_num();
+    char* contents = (char*)malloc(block_num * block_size);
+
+    read_blocks(super_block.s_first_data_block + 1, block_num, contents);
 #ifdef DEBUG
-    printf("************ start printing group desc block ***************\n");
-    print_block(contents);
-    printf("************ stop printing group desc block ***************\n");
+    printf("************ start printing group desc table ***************\n");
+    for (i = 0; i < block_num; ++i) {
+        print_block(contents + i * block_size);
+    }
+    printf("************ stop printing group desc table ***************\n");
 #endif
+
+    group_desc_num = get_block_group_num();
+    group_descs = (struct ext2_group_desc*)malloc(
+            group_desc_num * sizeof(struct ext2_group_desc));
+    for (i = 0; i < group_desc_num; ++i) {
+        parse_group_desc((unsigned char*)contents + i * GROUP_DESC_SIZE, 
+                &group_descs[i]);
+    }
+    free(contents);
+}
+
+void free_group_desc_table() {
+    free(group_descs);
+    group_descs = NULL;
+    group_desc_num = 0;
 }
 
 struct ext2_group_desc read_group_desc(__u32 id) {
-    struct ext2_group_desc group_desc;
-    __u32 offset = id * GROUP_DESC_SIZE;
-    group_desc.bg_block_bitmap = 
-        parse_bytes_to_decimal_u(group_desc_block, offset, 4);
-    group_desc.bg_inode_bitmap = 
-        parse_bytes_to_decimal_u(group_desc_block, offset + 4, 4);
-    group_desc.bg_inode_table = 
-        parse_bytes_to_decimal_u(group_desc_block, offset + 8, 4);
-    group_desc.bg_free_blocks_count = 
-        parse_bytes_to_decimal_u(group_desc_block, offset + 12, 2);
-    group_desc.bg_free_inodes_count = 
-        parse_bytes_to_decimal_u(group_desc_block, offset + 14, 2);
-    group_desc.bg_used_dirs_count = 
-        parse_bytes_to_decimal_u(group_desc_block, offset + 16, 2);
-    return group_desc;
+    return group_descs[id];
 }
@@ -0,0 +1,110 @@
+/*
+ * Metadata layout of the block groups.
+ *
+ * Built once per partition from the superblock features and the 
+ * decoded group descriptors. For every group it records where the 
+ * superblock and GDT copies (if the group has any), the bitmaps and the
+ * inode table are. The same information is kept as a packed bitset of 
+ * metadata blocks, laid out like the block bitmap, so pass4 can merge 
+ * it into the computed bitmap with one OR.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+
+extern __u32 get_block_group_num();
+extern __u32 get_block_bitmap_bytes();
+extern __u32 get_group_desc_block_num();
+extern __u32 get_group_block_bitmap_block_num();
+extern __u32 get_group_inode_bitmap_block_num();
+extern __u32 get_group_inode_block_num();
+extern struct ext2_group_desc read_group_desc(__u32 id);
+extern void bitmap_set(char* bitmap, __u32 bit);
+
+/*
+ * Return 1 if n is a power of base
+ */
+static int is_power_of(__u32 n, __u32 base) {
+    while (n > 1 && n % base == 0) {
+        n /= base;
+    }
+    return n == 1;
+}
+
+/*
+ * Return 1 if the group holds a copy of the superblock and GDT.
+ * Without sparse_super every group has one, with it only groups 0, 1 
+ * and powers of 3, 5 and 7 do.
+ */
+int group_has_super(__u32 group_id) {
+    if (!(super_block.s_feature_ro_compat & 
+                EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+        return 1;
+    }
+    return group_id <= 1 || is_power_of(group_id, 3) || 
+        is_power_of(group_id, 5) || is_power_of(group_id, 7);
+}
+
+/*
+ * Mark blocks [start, start + num) in the metadata bitset.
+ * Blocks outside the filesystem (corrupted descriptors) are ignored.
+ */
+static void mark_meta_blocks(__u32 start, __u32 num) {
+    __u32 i;
+    for (i = 0; i < num; ++i) {
+        if (start + i >= super_block.s_first_data_block &&
+                start + i < super_block.s_blocks_count) {
+            bitmap_set(meta_block_bitmap, 
+                    start + i - super_block.s_first_data_block);
+        }
+    }
+}
+
+/*
+ * Build group_layouts and meta_block_bitmap.
+ * Must be called after read_group_desc_table()
+ */
+void build_group_layout() {
+    __u32 group_num = get_block_group_num();
+    __u32 gdt_num = get_group_desc_block_num();
+    if (super_block.s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO) {
+        gdt_num += super_block.s_padding1;
+    }
+    group_layouts = (GroupLayout*)calloc(group_num, sizeof(GroupLayout));
+    meta_block_bitmap = (char*)calloc(get_block_bitmap_bytes(), 
+            sizeof(char));
+
+    __u32 i;
+    for (i = 0; i < group_num; ++i) {
+        GroupLayout* layout = &group_layouts[i];
+        struct ext2_group_desc group_desc = read_group_desc(i);
+        if (group_has_super(i)) {
+            // with 1KB blocks block 0 is before group 0
+            layout->super_block = super_block.s_first_data_block + 
+                i * super_block.s_blocks_per_group;
+            layout->super_block_num = 1;
+            layout->gdt = layout->super_block + 1;
+            layout->gdt_num = gdt_num;
+        }
+        layout->block_bitmap = group_desc.bg_block_bitmap;
+        layout->block_bitmap_num = get_group_block_bitmap_block_num();
+        layout->inode_bitmap = group_desc.bg_inode_bitmap;
+        layout->inode_bitmap_num = get_group_inode_bitmap_block_num();
+        layout->inode_table = group_desc.bg_inode_table;
+        layout->inode_table_num = get_group_inode_block_num();
+
+        mark_meta_blocks(layout->super_block, layout->super_block_num);
+        mark_meta_blocks(layout->gdt, layout->gdt_num);
+        mark_meta_blocks(layout->block_bitmap, layout->block_bitmap_num);
+        mark_meta_blocks(layout->inode_bitmap, layout->inode_bitmap_num);
+        mark_meta_blocks(layout->inode_table, layout->inode_table_num);
+    }
+}
+
+void free_group_layout() {
+    free(group_layouts);
+    group_layouts = NULL;
+    free(meta_block_bitmap);
+    meta_block_bitmap = NULL;
+}
@@ -1,83 +1,78 @@
 #include "common.h"
 #include "util.h"
+#include "readPlan.h"
 
 //#define DEBUG
 
 #define bits_per_byte 8
 
 extern struct ext2_group_desc read_group_desc(__u32 id);
+extern __u32 bitmap_find_next(char* bitmap, __u32 start, __u32 end);
 int read_group_inode_table(__u32 block_offset, char* group_inode_table);
 __u32 get_inode_bitmap_block_num();
 __u32 get_group_inode_block_num();
 __u32 get_group_inode_bitmap_block_num();
-inline __u32 get_inode_group_num();
+__u32 get_inode_group_num();
 inline __u32 get_inode_group_offset(__u32);
 inline __u32 get_inode_offset_in_group(__u32);
 inline __u32 get_file_type_from_inode(struct ext2_inode*);
 
 /*
  * note that inode id start from 1, not 0
+ * Only the inode table block holding the inode is read.
  */
 struct ext2_inode read_inode(__u32 inode_num) {
     // read corresponding group descriptor
     __u32 group_id = get_inode_group_offset(inode_num);
     struct ext2_group_desc group_desc = read_group_desc(group_id);
-    // inode table size in one group, round to multiple of block size
-    __u32 inode_table_size = get_group_inode_block_num() * block_size;
-    char inode_table[inode_table_size];
-    // read the inode table
-    int64_t start_sector = partition_entry.start;
-    int block_num = read_group_inode_table(group_desc.bg_inode_table, inode_table);
+    __u32 offset = get_inode_offset_in_group(inode_num) * INODE_SIZE;
+    char inode_block[block_size];
+    read_block(group_desc.bg_inode_table + offset / block_size, 
+            block_size, inode_block);
 
     struct ext2_inode inode;
-    __u32 offset = get_inode_offset_in_group(inode_num) * INODE_SIZE;
+    offset %= block_size;
 
-    inode.i_mode = parse_bytes_to_decimal_u(inode_table, offset, 2);
-    inode.i_uid = parse_bytes_to_decimal_u(inode_table, offset + 2, 2);
-    inode.i_size = parse_bytes_to_decimal_u(inode_table, offset + 4, 4);
-    inode.i_atime = parse_bytes_to_decimal_u(inode_table, offset + 8, 4);
-    inode.i_ctime = parse_bytes_to_decimal_u(inode_table, offset + 12, 4);
-    inode.i_mtime = parse_bytes_to_decimal_u(inode_table, offset + 16, 4);
-    inode.i_dtime = parse_bytes_to_decimal_u(inode_table, offset + 20, 4);
-    inode.i_gid = parse_bytes_to_decimal_u(inode_table, offset + 24, 2);
-    inode.i_links_count = parse_bytes_to_decimal_u(inode_table, offset + 26, 2);
-    inode.i_blocks = parse_bytes_to_decimal_u(inode_table, offset + 28, 4);
-    inode.i_flags = parse_bytes_to_decimal_u(inode_table, offset + 32, 4);
+    inode.i_mode = parse_bytes_to_decimal_u(inode_block, offset, 2);
+    inode.i_uid = parse_bytes_to_decimal_u(inode_block, offset + 2, 2);
+    inode.i_size = parse_bytes_to_decimal_u(inode_block, offset + 4, 4);
+    inode.i_atime = parse_bytes_to_decimal_u(inode_block, offset + 8, 4);
+    inode.i_ctime = parse_bytes_to_decimal_u(inode_block, offset + 12, 4);
+    inode.i_mtime = parse_bytes_to_decimal_u(inode_block, offset + 16, 4);
+    inode.i_dtime = parse_bytes_to_decimal_u(inode_block, offset + 20, 4);
+    inode.i_gid = parse_bytes_to_decimal_u(inode_block, offset + 24, 2);
+    inode.i_links_count = parse_bytes_to_decimal_u(inode_block, offset + 26, 2);
+    inode.i_blocks = parse_bytes_to_decimal_u(inode_block, offset + 28, 4);
+    inode.i_flags = parse_bytes_to_decimal_u(inode_block, offset + 32, 4);
     // ignore operting system info here, which is offset+36
     int i;
     for (i = 0; i < EXT2_N_BLOCKS; ++i) {
         inode.i_block[i] = parse_bytes_to_decimal_u(
-                inode_table, offset + 40 + i * 4, 4);
+                inode_block, offset + 40 + i * 4, 4);
     }
 
     return inode;
 }
 
+/*
+ * Write the inode's links count, and keep inode_summary in sync
+ */
 void write_inode(__u32 inode_num, __u32 links_count) {
     // read corresponding group descriptor
     __u32 group_id = get_inode_group_offset(inode_num);
     struct ext2_group_desc group_desc = read_group_desc(group_id);
-    // inode table size in one group, round to multiple of block size
-    __u32 inode_table_size = get_group_inode_block_num() * block_size;
-    char inode_table[inode_table_size];
-    // read the inode table
-    int64_t start_sector = partition_entry.start;
-    int block_num = read_group_inode_table(
-            group_desc.bg_inode_table, inode_table);
-
-    struct ext2_inode inode;
     __u32 offset = get_inode_offset_in_group(inode_num) * INODE_SIZE;
-    __u32 index = offset / block_size;
+    __u32 block_id = group_desc.bg_inode_table + offset / block_size;
     __u32 offset_in_block = offset % block_size + 26;
+    char inode_block[block_size];
+    read_block(block_id, block_size, inode_block);
 
     // write it into inode table
-    write_number_into_block(inode_table + index * block_size, 
-            offset_in_block, links_count, 2);
-    inode.i_links_count = parse_bytes_to_decimal_u(
-            inode_table, offset + 26, 2);
-    write_block(group_desc.bg_inode_table + index, 
-            block_size, inode_table + index * block_size);
-
+    write_number_into_block(inode_block, offset_in_block, links_count, 2);
+    write_block(block_id, block_size, inode_block);
+    if (inode_summary.links_count != NULL) {
+        inode_summary.links_count[inode_num] = links_count;
+    }
 }
 
 /*
@@ -85,13 +80,8 @@ void write_inode(__u32 inode_num, __u32 links_count) {
  * Return how many inodes block in a group
  */
 int read_group_inode_table(__u32 block_offset, char* group_inode_table) {
-    int64_t partition_start = partition_entry.start;
     __u32 inode_block_per_group = get_group_inode_block_num();
-    __u32 i;
-    for (i = 0; i < inode_block_per_group; ++i) {
-        read_block(block_offset + i, 
-                block_size, group_inode_table + block_size * i);
-    }
+    read_blocks(block_offset, inode_block_per_group, group_inode_table);
     return inode_block_per_group;
 }
 
@@ -102,31 +92,108 @@ void get_inode_bitmap_in_group(char* inode_bitmap,
         __u32 group_id, __u32 block_num) {
     // get group descriptor
     struct ext2_group_desc group_desc = read_group_desc(group_id);
-    // the block number of the first inode bitmap block
-    __u32 start_block = group_desc.bg_inode_bitmap;
-    __u32 i;
-    for (i = 0; i < block_num; ++i) {
-        read_block(start_block + i, 
-                block_size, inode_bitmap + i * block_size);
-    }
+    read_blocks(group_desc.bg_inode_bitmap, block_num, inode_bitmap);
 }
 
 /*
- * Load all inode_bitmap in the partition
+ * Return the size in bytes of the packed inode bitmap.
+ * The groups' bitmaps are packed one after another, so bit (n - 1)
+ * is inode n for every group. The size is rounded up to whole blocks
+ * for the bitmap diff kernel.
+ */
+__u32 get_inode_bitmap_bytes() {
+    __u32 group_bytes = super_block.s_inodes_per_group / bits_per_byte;
+    __u32 size = get_inode_group_num() * group_bytes;
+    return (size + block_size - 1) / block_size * block_size;
+}
+
+/*
+ * Load all inode_bitmap in the partition, packed as described in 
+ * get_inode_bitmap_bytes()
+ * Read with a plan like get_block_bitmap_in_partition()
  */
 char* get_inode_bitmap_in_partition() {
     __u32 group_num = get_inode_group_num();
     __u32 block_num = get_group_inode_bitmap_block_num();
-    __u32 size = group_num * block_num * block_size;
-    char* bitmap = (char*)malloc(size * sizeof(char));
-    __u32 i;
-    for (i = 0; i < group_num; ++i) {
-        get_inode_bitmap_in_group(bitmap + 
-                i * block_num * block_size, i, block_num);
+    __u32 group_bytes = super_block.s_inodes_per_group / bits_per_byte;
+    char* bitmap = (char*)calloc(get_inode_bitmap_bytes(), sizeof(char));
+    char* group_bitmaps = 
+        (char*)malloc(BITMAP_READ_GROUPS * block_num * block_size);
+    ReadPlan plan;
+    __u32 i, j;
+    read_plan_init(&plan, read_gap_blocks);
+    for (i = 0; i < group_num; i += BITMAP_READ_GROUPS) {
+        for (j = i; j < group_num && j < i + BITMAP_READ_GROUPS; ++j) {
+            read_plan_add_range(&plan, read_group_desc(j).bg_inode_bitmap, 
+                    block_num, group_bitmaps + (j - i) * block_num * block_size);
+        }
+        read_plan_execute(&plan);
+        for (j = i; j < group_num && j < i + BITMAP_READ_GROUPS; ++j) {
+            memcpy(bitmap + j * group_bytes, 
+                    group_bitmaps + (j - i) * block_num * block_size, 
+                    group_bytes);
+        }
     }
+    read_plan_free(&plan);
+    free(group_bitmaps);
     return bitmap;
 }
 
+/*
+ * Write partition's inode bitmap into disk image.
+ * Only the groups whose bits changed are written, the bytes after the
+ * group's bits in its bitmap blocks are kept as they are on disk.
+ */
+void write_inode_bitmap_in_partition(char* bitmap) {
+    __u32 group_num = get_inode_group_num();
+    __u32 block_num = get_group_inode_bitmap_block_num();
+    __u32 group_bytes = super_block.s_inodes_per_group / bits_per_byte;
+    char* group_bitmap = (char*)malloc(block_num * block_size);
+    __u32 i, j;
+    for (i = 0; i < group_num; ++i) {
+        get_inode_bitmap_in_group(group_bitmap, i, block_num);
+        if (memcmp(group_bitmap, bitmap + i * group_bytes, 
+                    group_bytes) == 0) {
+            continue;
+        }
+        memcpy(group_bitmap, bitmap + i * group_bytes, group_bytes);
+        struct ext2_group_desc group_desc = read_group_desc(i);
+        for (j = 0; j < block_num; ++j) {
+            write_block(group_desc.bg_inode_bitmap + j, block_size, 
+                    group_bitmap + j * block_size);
+        }
+    }
+    free(group_bitmap);
+}
+
+/*
+ * Return the first allocated inode number >= inode_num, or 0 if
+ * there is none. The inode bitmap is scanned a word at a time, and
+ * groups whose descriptor says that all inodes are free are skipped
+ * without looking at their bitmap.
+ */
+__u32 next_alloc_inode(char* inode_bitmap, __u32 inode_num) {
+    __u32 inodes_per_group = super_block.s_inodes_per_group;
+    __u32 inodes_count = super_block.s_inodes_count;
+    while (inode_num != 0 && inode_num <= inodes_count) {
+        __u32 group_id = get_inode_group_offset(inode_num);
+        __u32 group_end = (group_id + 1) * inodes_per_group;
+        if (group_end > inodes_count) {
+            group_end = inodes_count;
+        }
+        if (read_group_desc(group_id).bg_free_inodes_count < 
+                inodes_per_group) {
+            __u32 bit = bitmap_find_next(inode_bitmap, 
+                    inode_num - 1, group_end);
+            if (bit < group_end) {
+                return bit + 1;
+            }
+        }
+        inode_num = group_end + 1;
+    }
+    return 0;
+}
+
 /*
  * Return the inode's allocate bit in the inode bitmap
  * NOTE: 
@@ -174,7 +241,7 @@ __u32 get_group_inode_bitmap_block_num() {
 }
 
 
-inline __u32 get_inode_group_num() {
+__u32 get_inode_group_num() {
     __u32 inodes_per_group = super_block.s_inodes_per_group;
     return (super_block.s_inodes_count + 
             inodes_per_group - 1) / inodes_per_group;
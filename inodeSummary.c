@@ -0,0 +1,174 @@
+/*
+ * Columnar summary of all inodes in the partition.
+ *
+ * The inode tables are scanned once, group by group, and the fields 
+ * the passes need are kept in one compact array per field, indexed by 
+ * inode number. The scan is guided by the inode bitmap, so inode table
+ * blocks without allocated inodes are never read. The passes read 
+ * these arrays instead of decoding the 128 bytes inode records again 
+ * and again.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+#include "util.h"
+#include "readPlan.h"
+
+extern struct ext2_group_desc read_group_desc(__u32 id);
+extern __u32 get_inode_group_num();
+extern __u32 get_group_inode_block_num();
+extern char* bitmap_alloc(__u64 bits_num);
+extern void bitmap_set(char* bitmap, __u32 bit);
+extern char bitmap_test(char* bitmap, __u32 bit);
+extern __u32 bitmap_find_next(char* bitmap, __u32 start, __u32 end);
+
+/*
+ * Decode the summary fields of one inode record
+ */
+static void summarize_inode(unsigned char* inode, __u32 id) {
+    inode_summary.mode[id] = GET_LE16(inode);
+    inode_summary.size[id] = GET_LE32(inode + 4);
+    inode_summary.links_count[id] = GET_LE16(inode + 26);
+    inode_summary.blocks[id] = GET_LE32(inode + 28);
+    if (GET_LE32(inode + 20) != 0) {
+        bitmap_set(inode_summary.dtime, id);
+    }
+}
+
+/*
+ * Summarize the allocated inodes of one inode table block of the given
+ * size. first_inode is the number of the block's first inode.
+ */
+static ALWAYS_INLINE void summarize_inode_block_sized(char* block, 
+        __u32 first_inode, __u32 size) {
+    __u32 i;
+    for (i = 0; i < size / INODE_SIZE; ++i) {
+        if (first_inode + i <= super_block.s_inodes_count &&
+                bitmap_test(inode_bitmap, first_inode + i - 1)) {
+            summarize_inode((unsigned char*)block + i * INODE_SIZE, 
+                    first_inode + i);
+        }
+    }
+}
+
+#define summarize_inode_block_WRAPPER(suffix, size) \
+    static void summarize_inode_block_##suffix(char* block, \
+            __u32 first_inode) { \
+        summarize_inode_block_sized(block, first_inode, size); \
+    }
+
+DEFINE_BLOCK_KERNELS(SummarizeInodeBlockFunc, summarize_inode_block, 
+        select_summarize_inode_block)
+
+/*
+ * Return the first inode table block >= from of the group whose 
+ * inodes [first_bit, end_bit) has an allocated inode, or 
+ * table_block_num if there is none.
+ */
+static __u32 next_used_table_block(__u32 first_bit, __u32 end_bit, 
+        __u32 from) {
+    __u32 inodes_per_block = block_size / INODE_SIZE;
+    __u32 table_block_num = get_group_inode_block_num();
+    __u32 bit;
+    if (from >= table_block_num) {
+        return table_block_num;
+    }
+    bit = bitmap_find_next(inode_bitmap, 
+            first_bit + from * inodes_per_block, end_bit);
+    if (bit >= end_bit) {
+        return table_block_num;
+    }
+    return (bit - first_bit) / inodes_per_block;
+}
+
+/*
+ * Summarize the allocated inodes of one group. Only the inode table
+ * blocks holding at least one allocated inode are read, with a read 
+ * plan, so nearby blocks share one request.
+ */
+static void summarize_group(char* inode_table, __u32 group_id) {
+    struct ext2_group_desc group_desc = read_group_desc(group_id);
+    __u32 inodes_per_block = block_size / INODE_SIZE;
+    __u32 table_block_num = get_group_inode_block_num();
+    __u32 first_bit = group_id * super_block.s_inodes_per_group;
+    __u32 end_bit = first_bit + super_block.s_inodes_per_group;
+    if (end_bit > super_block.s_inodes_count) {
+        end_bit = super_block.s_inodes_count;
+    }
+
+    ReadPlan plan;
+    __u32 i;
+    read_plan_init(&plan, read_gap_blocks);
+    for (i = next_used_table_block(first_bit, end_bit, 0); 
+            i < table_block_num; 
+            i = next_used_table_block(first_bit, end_bit, i + 1)) {
+        read_plan_add(&plan, group_desc.bg_inode_table + i, 
+                inode_table + i * block_size);
+    }
+    read_plan_execute(&plan);
+    read_plan_free(&plan);
+
+    // decode the allocated inodes of the blocks read
+    for (i = next_used_table_block(first_bit, end_bit, 0); 
+            i < table_block_num; 
+            i = next_used_table_block(first_bit, end_bit, i + 1)) {
+        block_kernels.summarize_inode_block(inode_table + i * block_size,
+                first_bit + i * inodes_per_block + 1);
+    }
+}
+
+/*
+ * Scan the inode tables once and fill inode_summary.
+ * Only allocated inodes (per inode_bitmap) are summarized, the fields
+ * of free inodes stay 0. Groups without any allocated inode are skipped.
+ */
+void build_inode_summary() {
+    __u32 inodes_count = super_block.s_inodes_count;
+    __u32 table_block_num = get_group_inode_block_num();
+    __u32 group_num = get_inode_group_num();
+    char* inode_table = (char*)malloc(table_block_num * block_size);
+
+    inode_summary.inodes_count = inodes_count;
+    inode_summary.mode = 
+        (__u16*)calloc((size_t)inodes_count + 1, sizeof(__u16));
+    inode_summary.links_count = 
+        (__u16*)calloc((size_t)inodes_count + 1, sizeof(__u16));
+    inode_summary.size = 
+        (__u32*)calloc((size_t)inodes_count + 1, sizeof(__u32));
+    inode_summary.blocks = 
+        (__u32*)calloc((size_t)inodes_count + 1, sizeof(__u32));
+    inode_summary.dtime = bitmap_alloc((__u64)inodes_count + 1);
+
+    __u32 i;
+    for (i = 0; i < group_num; ++i) {
+        if (read_group_desc(i).bg_free_inodes_count >= 
+                super_block.s_inodes_per_group) {
+            continue;
+        }
+        summarize_group(inode_table, i);
+    }
+    free(inode_table);
+}
+
+/*
+ * Add one inode that was not allocated when the summary was built
+ */
+void add_to_inode_summary(__u32 inode_num, struct ext2_inode* inode) {
+    inode_summary.mode[inode_num] = inode->i_mode;
+    inode_summary.size[inode_num] = inode->i_size;
+    inode_summary.links_count[inode_num] = inode->i_links_count;
+    inode_summary.blocks[inode_num] = inode->i_blocks;
+    if (inode->i_dtime != 0) {
+        bitmap_set(inode_summary.dtime, inode_num);
+    }
+}
+
+void free_inode_summary() {
+    free(inode_summary.mode);
+    free(inode_summary.links_count);
+    free(inode_summary.size);
+    free(inode_summary.blocks);
+    free(inode_summary.dtime);
+    memset(&inode_summary, 0, sizeof(InodeSummary));
+}
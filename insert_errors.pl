@@ -100,7 +100,10 @@ sub extract_partition {
   
     my $start = $g_partition_table{$g_partition_num}->[0];
     my $end = $g_partition_table{$g_partition_num}->[1];
-    my $cmd = "dd if=$g_image_file of=$g_partition_file bs=512 ".
+    # myfsck copies it with copy_file_range and keeps the holes
+    my $cmd = (-x "./myfsck") ?
+        "./myfsck -i $g_image_file -x $g_partition_num -o $g_partition_file" :
+        "dd if=$g_image_file of=$g_partition_file bs=512 ".
         "skip=$start count=$end";
     
     if (system($cmd) != 0) {
@@ -0,0 +1,172 @@
+#!/usr/bin/perl -w
+
+##
+# Builds a sparse disk image whose only ext2 partition starts past
+# sector 2^32 (2 TiB), and checks that myfsck prints, scans, repairs
+# and exports it at the right place. Sector offsets kept in 32 bits
+# wrap there and read the wrong sectors.
+#
+# The image is about 2 TiB long, but only the partition is written, so
+# tmp_dir must be on a filesystem with sparse files (ext4, xfs, tmpfs).
+##
+
+#### Package declarations ###########
+
+use strict;
+use warnings;
+use diagnostics;
+use Getopt::Long;
+use File::Compare;
+
+########
+
+# The extended partition starts just below 2^32 sectors, its logical
+# partition 5 starts past it: 0xFFFF0000 + 0x20000 = 4295032832
+my $g_ext_start = 0xFFFF0000;
+my $g_logical_offset = 0x20000;
+my $g_part_start = $g_ext_start + $g_logical_offset;
+my $g_part_length = 49152;
+
+my $g_sector_size = 512;
+
+my $g_myfsck_exec = "./myfsck";
+my $g_mke2fs_exec = "/sbin/mke2fs";
+my $g_debugfs_exec = "/sbin/debugfs";
+my $g_fsck_exec = "/sbin/fsck.ext2";
+
+my $g_tmp_dir;
+
+my $g_failures = 0;
+
+
+########
+
+sub print_usage {
+    print "./large_image_test.pl --tmp_dir\n";
+    print "\ttmp_dir: Directory in which to place the sparse image\n";
+}
+
+sub get_options {
+    GetOptions("tmp_dir=s"     => \$g_tmp_dir);
+
+    if (!defined $g_tmp_dir) {
+	print_usage();
+	exit(-1);
+    }
+}
+
+sub run {
+    my ($cmd) = @_;
+    if (system($cmd) != 0) {
+	print "Failed: $cmd\n";
+	exit(-1);
+    }
+}
+
+##
+# Creates an empty file of the given size, without writing to it
+##
+sub create_sparse_file {
+    my ($file, $size) = @_;
+    open(my $fh, ">", $file) or die "Cannot create $file: $!";
+    truncate($fh, $size) or die "Cannot truncate $file: $!";
+    close($fh);
+}
+
+##
+# Writes a partition table entry into the sector at the given offset
+##
+sub write_entry {
+    my ($fh, $offset, $type, $start, $length) = @_;
+    my $entry = pack("C C3 C C3 V V", 0, 0, 0, 0, $type, 0, 0, 0,
+		     $start, $length);
+    sysseek($fh, $offset + 446, 0) or die "Cannot seek: $!";
+    syswrite($fh, $entry) == 16 or die "Cannot write entry: $!";
+    sysseek($fh, $offset + 510, 0) or die "Cannot seek: $!";
+    syswrite($fh, pack("C2", 0x55, 0xAA)) == 2 or die "Cannot write: $!";
+}
+
+##
+# An ext2 filesystem with one error: lost+found has a wrong links count.
+# 128 byte inodes and no newer features, like the provided disk image.
+##
+sub make_partition {
+    my ($part_file) = @_;
+    create_sparse_file($part_file, $g_part_length * $g_sector_size);
+    run("$g_mke2fs_exec -q -F -t ext2 -b 1024 -I 128 " .
+	"-O ^resize_inode,^dir_index,^ext_attr $part_file >/dev/null");
+    run("echo 'sif lost+found links_count 7' | " .
+	"$g_debugfs_exec -w $part_file >/dev/null 2>&1");
+}
+
+##
+# MBR: one extended partition, holding one logical ext2 partition
+##
+sub make_image {
+    my ($image_file, $part_file) = @_;
+    my $image_size = ($g_part_start + $g_part_length) * $g_sector_size;
+    create_sparse_file($image_file, $image_size);
+
+    open(my $fh, "+<", $image_file) or die "Cannot open $image_file: $!";
+    write_entry($fh, 0, 0x05, $g_ext_start,
+		$g_logical_offset + $g_part_length);
+    write_entry($fh, $g_ext_start * $g_sector_size, 0x83,
+		$g_logical_offset, $g_part_length);
+    close($fh);
+
+    run("dd if=$part_file of=$image_file bs=$g_sector_size " .
+	"seek=$g_part_start conv=notrunc,sparse status=none");
+}
+
+sub check {
+    my ($name, $ok) = @_;
+    print(($ok ? "PASS" : "FAIL") . ": $name\n");
+    $g_failures++ if (!$ok);
+}
+
+sub check_output {
+    my ($name, $cmd, $expected) = @_;
+    my $output = `$cmd`;
+    check($name, $? == 0 && $output eq $expected);
+    if ($output ne $expected) {
+	print "Expected:\n$expected" . "Got:\n$output";
+    }
+}
+
+sub run_tests {
+    my $part_file = "$g_tmp_dir/large_partition";
+    my $image_file = "$g_tmp_dir/large_image";
+    my $export_file = "$g_tmp_dir/large_export";
+    my $entry = sprintf("0x83 %d %d\n", $g_part_start, $g_part_length);
+
+    make_partition($part_file);
+    make_image($image_file, $part_file);
+
+    check_output("-p 5", "$g_myfsck_exec -i $image_file -p 5", $entry);
+    check_output("--scan-partitions",
+		 "$g_myfsck_exec -i $image_file --scan-partitions -p 1",
+		 "Found ext2 partition 1 at sector $g_part_start, " .
+		 "$g_part_length sectors\n" . $entry);
+
+    unlink($export_file);
+    run("$g_myfsck_exec -i $image_file -x 5 -o $export_file");
+    check("-x 5 before repair", compare($export_file, $part_file) == 0);
+
+    check_output("-f 5", "$g_myfsck_exec -i $image_file -f 5",
+		 "Inode 11 ref count is 7, should be 2\n");
+
+    unlink($export_file);
+    run("$g_myfsck_exec -i $image_file -x 5 -o $export_file");
+    system("$g_fsck_exec -f -n $export_file >/dev/null 2>&1");
+    check("-x 5 after repair is clean", $? == 0);
+
+    unlink($part_file, $image_file, $export_file);
+}
+
+
+#####
+
+get_options();
+run_tests();
+print "Found $g_failures failures\n";
+exit($g_failures == 0 ? 0 : -1);
@@ -3,16 +3,43 @@
  * It accepts the following arguments:
  *  1) i: disk image
  *  2) p: partition number to print information
+ *  3) f: partition number to check and correct, 0 for all
+ *  4) B: also validate the backup superblocks and group descriptors
+ *  5) report: write the problems found into a file instead of stdout
+ *  6) scan-partitions: find the ext2 partitions by their superblocks
+ *     instead of reading the partition table
+ *  7) read-gap: unwanted blocks a read may go through to merge two reads
+ *  8) direct: read the image with O_DIRECT, bypassing the page cache
+ *  9) max-iops, max-mbps: limit the I/O rate, idle-io: lowest I/O priority
+ * 10) overlay: keep the repairs in an overlay file, the image is only 
+ *     read. overlay-commit writes the overlay into the image, 
+ *     overlay-export writes the repaired image into a new file.
+ * 11) x, o: copy partition x of the image into file o
+ *
+ * The disk image may be a zstd seekable image, which is only read.
  *
  * Author: Xiaoxiang Wu
  * Andrew ID: xiaoxiaw
  */
 
+#define _GNU_SOURCE  /* for O_DIRECT */
+#include <errno.h>
+#include <inttypes.h>
 #include "common.h"
 #include "util.h"
+#include "report.h"
+#include "zstdImage.h"
+#include "overlay.h"
 
 extern void correct_partition(int partition_num);
 extern int print_partition_info(int partition_num);
+extern int scan_partitions();
+extern int direct_io_init();
+extern void direct_io_close();
+extern void io_limit_set(double iops, double bytes_per_second);
+extern double io_throttled_seconds();
+extern int io_set_idle_priority();
+extern int export_partition(int partition_num, const char* path);
 
 //#define DEBUG
 
@@ -20,7 +47,26 @@ void usage(const char* progname) {
     printf("Usage: %s [options]\n", progname);
     printf("Program Options:\n");
     printf("  -p <partition number>    partition to read\n");
-    printf("  -i <disk image>          path to disk image\n");
+    printf("  -i <disk image>          path to disk image, may be zstd "
+            "seekable\n");
+    printf("  -f <partition number>    partition to check, 0 for all\n");
+    printf("  -B                       validate backup superblocks and GDTs\n");
+    printf("  -x <partition number>    partition to export into -o file\n");
+    printf("  -o <file>                file to export the partition into\n");
+    printf("  --report <file>          write the problems found into file\n");
+    printf("  --report-format <fmt>    json (default) or bin\n");
+    printf("  --scan-partitions        find partitions by superblock, "
+            "not by partition table\n");
+    printf("  --read-gap <blocks>      merge reads at most this many blocks "
+            "apart (default %d)\n", READ_GAP_DEFAULT);
+    printf("  --direct                 bypass the page cache (O_DIRECT)\n");
+    printf("  --max-iops <n>           at most n I/O requests per second\n");
+    printf("  --max-mbps <n>           at most n MiB per second\n");
+    printf("  --idle-io                use the idle I/O priority class\n");
+    printf("  --overlay <file>         write repairs into file, not the image\n");
+    printf("  --overlay-commit         write the overlay into the image\n");
+    printf("  --overlay-export <file>  write the image with the overlay "
+            "into file\n");
     printf("  -h                       help information");
 }
 
@@ -28,11 +74,73 @@ int main(int argc, char** argv) {
     int opt;
     int print_partition_num = -1;
     int correct_partition_num = -1;
-    char* image_path;
+    int export_partition_num = -1;
+    char* output_path = NULL;
+    char* image_path = NULL;
     char help = 0;
+    char* report_path = NULL;
+    int report_binary = 0;
+    char scan = 0;
+    int read_gap = READ_GAP_DEFAULT;
+    double max_iops = 0;
+    double max_mbps = 0;
+    char idle_io = 0;
+    char* overlay_path = NULL;
+    char commit = 0;
+    char* export_path = NULL;
+    int flags;
+    int64_t pages;
+    static struct option long_options[] = {
+        {"report", required_argument, NULL, 'r'},
+        {"report-format", required_argument, NULL, 'R'},
+        {"scan-partitions", no_argument, NULL, 'S'},
+        {"read-gap", required_argument, NULL, 'g'},
+        {"direct", no_argument, NULL, 'D'},
+        {"max-iops", required_argument, NULL, 'I'},
+        {"max-mbps", required_argument, NULL, 'M'},
+        {"idle-io", no_argument, NULL, 'N'},
+        {"overlay", required_argument, NULL, 'O'},
+        {"overlay-commit", no_argument, NULL, 'C'},
+        {"overlay-export", required_argument, NULL, 'E'},
+        {NULL, 0, NULL, 0}
+    };
 
-    while ((opt = getopt(argc, argv, "p:f:i:?h")) != EOF) {
+    while ((opt = getopt_long(argc, argv, "p:f:i:x:o:B?h", 
+                    long_options, NULL)) != EOF) {
         switch (opt) {
+            case 'r':
+                report_path = optarg;
+                break;
+            case 'R':
+                report_binary = strcmp(optarg, "bin") == 0;
+                break;
+            case 'S':
+                scan = 1;
+                break;
+            case 'g':
+                read_gap = atoi(optarg);
+                break;
+            case 'D':
+                direct_io = 1;
+                break;
+            case 'I':
+                max_iops = atof(optarg);
+                break;
+            case 'M':
+                max_mbps = atof(optarg);
+                break;
+            case 'N':
+                idle_io = 1;
+                break;
+            case 'O':
+                overlay_path = optarg;
+                break;
+            case 'C':
+                commit = 1;
+                break;
+            case 'E':
+                export_path = optarg;
+                break;
             case 'p':
                 print_partition_num = atoi(optarg);
                 break;
@@ -42,15 +150,40 @@ int main(int argc, char** argv) {
             case 'i':
                 image_path = optarg;
                 break;
+            case 'x':
+                export_partition_num = atoi(optarg);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'B':
+                check_super_copies = 1;
+                break;
             case 'h':
                 help = 1;
                 break;
         }
     }
 
-    if (help == 1 || optind != 5) {
+    if (help == 1 || image_path == NULL) {
         usage(argv[0]);
     }
+    if (read_gap < 0) {
+        fprintf(stderr, "--read-gap must not be negative\n");
+        exit(-1);
+    }
+    // a read request never spans more than READ_PLAN_MAX_BLOCKS anyway
+    read_gap_blocks = read_gap > READ_PLAN_MAX_BLOCKS? 
+        READ_PLAN_MAX_BLOCKS: read_gap;
+    if (export_partition_num != -1 && output_path == NULL) {
+        fprintf(stderr, "-x needs -o <file>\n");
+        exit(-1);
+    }
+    if ((commit || export_path != NULL) && overlay_path == NULL) {
+        fprintf(stderr, "--overlay-commit and --overlay-export "
+                "need --overlay\n");
+        exit(-1);
+    }
 
 #ifdef DEBUG
     printf("print partion number: %d\n", print_partition_num);
@@ -58,15 +191,107 @@ int main(int argc, char** argv) {
     printf("image path: %s\n", image_path);
 #endif
 
-    if ((device = open(image_path, O_RDWR)) == -1) {
+    // with an overlay the image is only written by a commit
+    flags = (overlay_path != NULL && !commit)? O_RDONLY: O_RDWR;
+    if (direct_io) {
+        device = open(image_path, flags | O_DIRECT);
+        // e.g. tmpfs: keep our own buffers, still drop the pages at exit
+        if (device == -1 && errno == EINVAL) {
+            fprintf(stderr, "O_DIRECT not supported on %s, "
+                    "using buffered I/O\n", image_path);
+            device = open(image_path, flags);
+        }
+    } else {
+        device = open(image_path, flags);
+    }
+    if (device == -1) {
         perror("Fail to open disk image\n");
         exit(-1);
     }
+    opt = zstd_image_open(device);
+    if (opt == -1) {
+        exit(-1);
+    }
+    compressed_image = opt;
+    // a compressed image is read-only, repairs have to go to an overlay
+    if (compressed_image && correct_partition_num != -1 && 
+            overlay_path == NULL) {
+        fprintf(stderr, "-f on a compressed image needs --overlay <file>\n");
+        exit(-1);
+    }
+    if (compressed_image && commit) {
+        fprintf(stderr, "--overlay-commit cannot write a compressed image, "
+                "use --overlay-export\n");
+        exit(-1);
+    }
+    if (!compressed_image) {
+        hole_map_init();
+    }
+    if (compressed_image && direct_io) {
+        fprintf(stderr, "--direct is ignored for compressed images\n");
+        fcntl(device, F_SETFL, fcntl(device, F_GETFL) & ~O_DIRECT);
+        direct_io = 0;
+    }
+    if (direct_io) {
+        if (direct_io_init() == -1) {
+            perror("Fail to set up direct I/O");
+            exit(-1);
+        }
+        atexit(direct_io_close);
+    }
+
+    if (idle_io && io_set_idle_priority() == -1) {
+        perror("Fail to set idle I/O priority");
+    }
+    io_limit_set(max_iops, max_mbps * 1024 * 1024);
+
+    if (overlay_path != NULL) {
+        if (overlay_open(overlay_path, get_image_size()) == -1) {
+            exit(-1);
+        }
+        use_overlay = 1;
+    }
+    if (commit || export_path != NULL) {
+        if (commit) {
+            pages = overlay_commit();
+        } else {
+            pages = overlay_export(export_path);
+        }
+        if (pages == -1) {
+            perror(commit? "Fail to commit overlay": "Fail to export image");
+            exit(-1);
+        }
+        printf("%"PRId64" overlay pages written into %s\n", pages, 
+                commit? image_path: export_path);
+        if (overlay_close() == -1) {
+            perror("Fail to close overlay");
+            exit(-1);
+        }
+        return 0;
+    }
 
-    if (print_partition_num != -1) {
+    if (scan) {
+        scan_partitions();
+    }
+
+    if (export_partition_num != -1) {
+        return export_partition(export_partition_num, output_path);
+    } else if (print_partition_num != -1) {
         return print_partition_info(print_partition_num);
     } else if (correct_partition_num != -1) {
+        if (report_path != NULL && 
+                report_open(report_path, report_binary) == -1) {
+            exit(-1);
+        }
         correct_partition(correct_partition_num);
+        report_close();
+    }
+    if (use_overlay && overlay_close() == -1) {
+        perror("Fail to close overlay");
+        exit(-1);
+    }
+    if (max_iops > 0 || max_mbps > 0) {
+        printf("I/O throttled for %.3f seconds\n", io_throttled_seconds());
     }
 
     return 0;
@@ -0,0 +1,331 @@
+/*
+ * Copy-on-write overlay for repairs (--overlay FILE).
+ *
+ * Every write lands in the overlay file instead of the image, one 
+ * OVERLAY_PAGE page at a time, and reads take the pages found there on
+ * top of the image. The overlay file is
+ *   header (one page): "MFSO", version, page size, image size
+ *   page bitmap: one bit per image page, set if the page is in the 
+ *                overlay, rounded up to whole pages
+ *   data: image page n at data offset + n * OVERLAY_PAGE
+ * and stays sparse, only the pages written take space. The overlay can
+ * later be committed into the image, or merged with it into a new 
+ * repaired image.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "overlay.h"
+
+#define OVERLAY_MAGIC "MFSO"
+#define OVERLAY_VERSION 1
+#define OVERLAY_PAGE 4096
+
+#define PUT_LE32(p, v) do { (p)[0] = (v) & 0xFF; (p)[1] = ((v) >> 8) & 0xFF; \
+        (p)[2] = ((v) >> 16) & 0xFF; (p)[3] = ((v) >> 24) & 0xFF; } while (0)
+#define GET_LE32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | \
+        (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+
+extern ssize_t pread_full (int fd, char *buf, size_t len, off_t offset);
+extern int pwrite_full (int fd, const char *buf, size_t len, off_t offset);
+extern int read_base_image (off_t offset, size_t len, char *into);
+extern int write_base_image (off_t offset, size_t len, const char *from);
+extern int copy_image_range (int in_fd, int64_t in_offset, int out_fd, 
+        int64_t out_offset, int64_t len);
+extern char compressed_image;
+extern int device;
+
+static int overlay_fd = -1;
+static int64_t image_bytes;
+static int64_t page_num;
+static unsigned char* page_bitmap;
+static int64_t bitmap_bytes;   /* on disk, rounded up to pages */
+
+#define PAGE_PRESENT(n) (page_bitmap[(n) >> 3] & (1 << ((n) & 7)))
+#define DATA_OFFSET (OVERLAY_PAGE + bitmap_bytes)
+
+/*
+ * Open the overlay file, creating it for an image of image_size bytes 
+ * if it does not exist. Return 0, or -1 after printing why.
+ */
+int overlay_open(const char* path, int64_t image_size) {
+    unsigned char header[OVERLAY_PAGE];
+    int64_t size;
+    ssize_t ret;
+
+    image_bytes = image_size;
+    page_num = (image_size + OVERLAY_PAGE - 1) / OVERLAY_PAGE;
+    bitmap_bytes = ((page_num + 7) / 8 + OVERLAY_PAGE - 1) / 
+        OVERLAY_PAGE * OVERLAY_PAGE;
+    page_bitmap = (unsigned char*)calloc(bitmap_bytes, 1);
+    overlay_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (overlay_fd == -1 || page_bitmap == NULL) {
+        perror("Fail to open overlay");
+        return -1;
+    }
+
+    ret = pread_full(overlay_fd, (char*)header, OVERLAY_PAGE, 0);
+    if (ret == -1) {
+        perror("Fail to read overlay");
+        return -1;
+    }
+    if (ret == 0) {
+        // a new overlay
+        memset(header, 0, OVERLAY_PAGE);
+        memcpy(header, OVERLAY_MAGIC, 4);
+        PUT_LE32(header + 4, OVERLAY_VERSION);
+        PUT_LE32(header + 8, OVERLAY_PAGE);
+        PUT_LE32(header + 16, (uint32_t)image_size);
+        PUT_LE32(header + 20, (uint32_t)(image_size >> 32));
+        if (pwrite_full(overlay_fd, (char*)header, OVERLAY_PAGE, 0) == -1 ||
+                ftruncate(overlay_fd, DATA_OFFSET) == -1) {
+            perror("Fail to create overlay");
+            return -1;
+        }
+        return 0;
+    }
+
+    // e.g. a crash while the overlay was created
+    if (ret != OVERLAY_PAGE) {
+        fprintf(stderr, "Overlay %s has a partial header\n", path);
+        return -1;
+    }
+    size = GET_LE32(header + 16) | (int64_t)GET_LE32(header + 20) << 32;
+    if (memcmp(header, OVERLAY_MAGIC, 4) != 0 || 
+            GET_LE32(header + 4) != OVERLAY_VERSION ||
+            GET_LE32(header + 8) != OVERLAY_PAGE) {
+        fprintf(stderr, "%s is not a myfsck overlay\n", path);
+        return -1;
+    }
+    if (size != image_size) {
+        fprintf(stderr, "Overlay %s is for an image of %"PRId64" bytes, "
+                "not %"PRId64"\n", path, size, image_size);
+        return -1;
+    }
+    ret = pread_full(overlay_fd, (char*)page_bitmap, bitmap_bytes, 
+            OVERLAY_PAGE);
+    if (ret == -1) {
+        perror("Fail to read overlay");
+        return -1;
+    }
+    if (ret != bitmap_bytes) {
+        fprintf(stderr, "Overlay %s is truncated\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Copy the overlay pages inside [offset, offset + len) over buf, which
+ * holds these bytes of the image. Return 0, or -1 with errno set.
+ */
+int overlay_patch(int64_t offset, size_t len, char* buf) {
+    int64_t page = offset / OVERLAY_PAGE;
+    int64_t end = offset + len;
+    int64_t from, to;
+    ssize_t ret;
+
+    for (; page * OVERLAY_PAGE < end; ++page) {
+        if (!PAGE_PRESENT(page)) {
+            continue;
+        }
+        from = page * OVERLAY_PAGE > offset? page * OVERLAY_PAGE: offset;
+        to = (page + 1) * OVERLAY_PAGE < end? 
+            (page + 1) * OVERLAY_PAGE: end;
+        ret = pread_full(overlay_fd, buf + (from - offset), to - from, 
+                DATA_OFFSET + from);
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret != to - from) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Put one page into the overlay: the first time a page is written, the
+ * rest of it comes from the image.
+ */
+static int write_page(int64_t page, int64_t from, int64_t to, 
+        const char* data) {
+    char buf[OVERLAY_PAGE];
+    int64_t start = page * OVERLAY_PAGE;
+    int64_t size = image_bytes - start < OVERLAY_PAGE? 
+        image_bytes - start: OVERLAY_PAGE;
+    unsigned char* byte = &page_bitmap[page >> 3];
+
+    if (PAGE_PRESENT(page)) {
+        return pwrite_full(overlay_fd, data, to - from, DATA_OFFSET + from);
+    }
+    if (to - from < size && read_base_image(start, size, buf) == -1) {
+        return -1;
+    }
+    memcpy(buf + (from - start), data, to - from);
+    if (pwrite_full(overlay_fd, buf, size, DATA_OFFSET + start) == -1) {
+        return -1;
+    }
+    // the data is in place before the page is marked
+    *byte |= 1 << (page & 7);
+    return pwrite_full(overlay_fd, (char*)byte, 1, 
+            OVERLAY_PAGE + (page >> 3));
+}
+
+/*
+ * Write [offset, offset + len) into the overlay.
+ * Return 0, or -1 with errno set.
+ */
+int overlay_write(int64_t offset, size_t len, const char* from) {
+    int64_t page = offset / OVERLAY_PAGE;
+    int64_t end = offset + len;
+    int64_t lo, hi;
+
+    if (end > image_bytes) {
+        errno = EIO;
+        return -1;
+    }
+    for (; page * OVERLAY_PAGE < end; ++page) {
+        lo = page * OVERLAY_PAGE > offset? page * OVERLAY_PAGE: offset;
+        hi = (page + 1) * OVERLAY_PAGE < end? (page + 1) * OVERLAY_PAGE: end;
+        if (write_page(page, lo, hi, from + (lo - offset)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read one overlay page, cut at the end of the image
+ */
+static int64_t read_page(int64_t page, char* buf) {
+    int64_t start = page * OVERLAY_PAGE;
+    int64_t size = image_bytes - start < OVERLAY_PAGE? 
+        image_bytes - start: OVERLAY_PAGE;
+    if (pread_full(overlay_fd, buf, size, DATA_OFFSET + start) != size) {
+        return -1;
+    }
+    return size;
+}
+
+/*
+ * Write every overlay page into the image. The overlay is synced first,
+ * so a commit cut short can be run again, and the image before success
+ * is reported. Return the pages written, or -1 with errno set.
+ */
+int64_t overlay_commit() {
+    char buf[OVERLAY_PAGE];
+    int64_t page, size, written = 0;
+
+    if (fsync(overlay_fd) == -1) {
+        return -1;
+    }
+    for (page = 0; page < page_num; ++page) {
+        if (!PAGE_PRESENT(page)) {
+            continue;
+        }
+        size = read_page(page, buf);
+        if (size == -1 || 
+                write_base_image(page * OVERLAY_PAGE, size, buf) == -1) {
+            return -1;
+        }
+        ++written;
+    }
+    if (fsync(device) == -1) {
+        return -1;
+    }
+    return written;
+}
+
+/*
+ * Write the image with the overlay applied into a new file. The image 
+ * is copied with copy_file_range, which shares the extents when the 
+ * filesystem can (reflink), then the overlay pages are written on top.
+ * Return the pages taken from the overlay, or -1 with errno set.
+ */
+int64_t overlay_export(const char* path) {
+    char buf[OVERLAY_PAGE];
+    char* chunk;
+    int64_t page, size, done, num, written = 0;
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (out == -1) {
+        return -1;
+    }
+    if (ftruncate(out, image_bytes) == -1) {
+        close(out);
+        return -1;
+    }
+    if (!compressed_image) {
+        if (copy_image_range(device, 0, out, 0, image_bytes) == -1) {
+            close(out);
+            return -1;
+        }
+    } else {
+        // nothing to share, decompress
+        chunk = (char*)malloc(OVERLAY_PAGE * 256);
+        for (done = 0; done < image_bytes; done += num) {
+            num = image_bytes - done < OVERLAY_PAGE * 256? 
+                image_bytes - done: OVERLAY_PAGE * 256;
+            if (read_base_image(done, num, chunk) == -1 || 
+                    pwrite_full(out, chunk, num, done) == -1) {
+                free(chunk);
+                close(out);
+                return -1;
+            }
+        }
+        free(chunk);
+    }
+
+    for (page = 0; page < page_num; ++page) {
+        if (!PAGE_PRESENT(page)) {
+            continue;
+        }
+        size = read_page(page, buf);
+        if (size == -1 || 
+                pwrite_full(out, buf, size, page * OVERLAY_PAGE) == -1) {
+            close(out);
+            return -1;
+        }
+        ++written;
+    }
+    if (fsync(out) == -1) {
+        close(out);
+        return -1;
+    }
+    if (close(out) == -1) {
+        return -1;
+    }
+    return written;
+}
+
+/*
+ * Sync and close the overlay. Return 0, or -1 with errno set.
+ */
+int overlay_close() {
+    int ret = 0;
+
+    if (overlay_fd != -1) {
+        if (fsync(overlay_fd) == -1) {
+            ret = -1;
+        }
+        if (close(overlay_fd) == -1) {
+            ret = -1;
+        }
+    }
+    overlay_fd = -1;
+    free(page_bitmap);
+    page_bitmap = NULL;
+    return ret;
+}
@@ -0,0 +1,6 @@
+int overlay_open(const char* path, int64_t image_size);
+int overlay_patch(int64_t offset, size_t len, char* buf);
+int overlay_write(int64_t offset, size_t len, const char* from);
+int64_t overlay_commit();
+int64_t overlay_export(const char* path);
+int overlay_close();
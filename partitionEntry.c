@@ -1,97 +1,151 @@
 /*
  * Read information about partition entry from MBR and EBR.
  *
+ * The MBR and the whole EBR chain are parsed once, the first time a 
+ * partition is asked for, into partition_table. Partitions 1 to 4 are
+ * the MBR entries, the logical partitions follow from 5 on. Every
+ * later lookup is served from the table without reading the disk.
+ *
  * Author: Xiaoxiang Wu
  * Andrew ID: xiaoxiaw
  */
 #include "partitionEntry.h"
 
+// no real chain is this long, a longer one is looping
+#define MAX_EBR_NUM 4096
+
 /*
- * read the MBR from section 0 in the disk image
+ * Append an entry to partition_table
  */
-int read_mbr(char* MBR, PartitionEntry* parition_entry, 
-        int partition_num) {
-    int offset = FIRST_PARTITION_OFFSET + 
-        PARTITION_ENTRY_SIZE * (partition_num - 1);
-    int i;
-    read_partition_entry(MBR, 0, offset, parition_entry);
+static void add_partition(PartitionEntry* entry, int* capacity) {
+    if (partition_table_num == *capacity) {
+        *capacity *= 2;
+        partition_table = (PartitionEntry*)realloc(partition_table, 
+                *capacity * sizeof(PartitionEntry));
+    }
+    partition_table[partition_table_num++] = *entry;
+}
+
+/*
+ * Add an EBR sector to the sorted list of those read while walking the
+ * chain. Return 1 if it was already there, 0 if it was added.
+ */
+static int ebr_insert(__u64* ebrs, int* ebr_num, __u64 sector) {
+    int low = 0, high = *ebr_num, mid;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (ebrs[mid] == sector) {
+            return 1;
+        }
+        if (ebrs[mid] < sector) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    memmove(ebrs + low + 1, ebrs + low, (*ebr_num - low) * sizeof(__u64));
+    ebrs[low] = sector;
+    ++*ebr_num;
     return 0;
 }
 
 /*
- * Read a partition from EBR
- * If the partition does not exist, set the return partition
- * entry's type to INVALID_TYPE
+ * Walk the EBR chain of the extended partition and append its logical
+ * partitions. A logical partition is followed by the next EBR, an
+ * extended entry starts a nested chain. The walk stops at the end of 
+ * the extended partition, at an empty entry, at an entry running past
+ * the end, and at an EBR seen before, so a malformed chain cannot loop.
  */
-PartitionEntry read_ebr(PartitionEntry* base_partition_entry, 
-        int partition_num) {
-    unsigned int start = base_partition_entry->start;;
-    unsigned int end = start + base_partition_entry->length;
-    unsigned int offset = FIRST_PARTITION_OFFSET;
+static void read_ebr_chain(PartitionEntry* base_partition_entry, 
+        int* capacity) {
+    __u64 start = base_partition_entry->start;
+    __u64 end = start + base_partition_entry->length;
     unsigned char new_sector[sector_size_bytes];
-    PartitionEntry partition_entry;
-    while (partition_num != 4) {
-        if (start >= end) {
-            partition_entry.type = INVALID_TYPE;
-            return partition_entry;
+    __u64* ebrs = (__u64*)malloc(MAX_EBR_NUM * sizeof(__u64));
+    int ebr_num = 0;
+    PartitionEntry entry;
+    while (start < end) {
+        if (ebr_num == MAX_EBR_NUM || ebr_insert(ebrs, &ebr_num, start)) {
+            fprintf(stderr, "EBR chain loops at sector %llu, "
+                    "ignoring the rest of it\n", (unsigned long long)start);
+            break;
+        }
+        if (read_sectors(start, 1, new_sector) == -1) {
+            perror("Cannot read EBR, ignoring the rest of the chain");
+            break;
         }
-        read_sectors(start, 1, new_sector);
 #ifdef PARTITION_ENTRY_DEBUG
         print_sector(new_sector);
 #endif
         read_partition_entry(new_sector, start, 
-                offset, &partition_entry);
-        if (partition_entry.start + partition_entry.length > end) {
-            partition_entry.type = INVALID_TYPE;
-            return partition_entry;
+                FIRST_PARTITION_OFFSET, &entry);
+        // an empty entry is the regular end of the chain
+        if (entry.type == 0 || entry.length == 0 || 
+                entry.start + entry.length > end) {
+            break;
         }
-        if (partition_entry.type == DOS_EXTENDED_PARTITION) {
-            return read_ebr(&partition_entry, partition_num);
+        if (entry.type == DOS_EXTENDED_PARTITION) {
+            start = entry.start;
+            end = entry.start + entry.length;
         } else {
-            --partition_num;
+            add_partition(&entry, capacity);
             // if not EBR, next partition is following current partition
-            start = partition_entry.start + partition_entry.length;
+            start = entry.start + entry.length;
         }
     }
-    return partition_entry;
+    free(ebrs);
 }
 
 /*
- * read the specific partition's information
- *  1) partition type
- *  2) start sector
- *  3) parition size
- *  If the partition does not exist, set the return partition
- *  entry's type to 0
+ * Parse the MBR and the EBR chain into partition_table
  */
-int read_partition_info(int partition_num) {
+void read_partition_table() {
     unsigned char MBR[sector_size_bytes];
-    read_sectors(0, 1, MBR);  // read the sector 0
+    int capacity = 16;
+    int i;
+    // read the sector 0, there is nothing to do without it
+    if (read_sectors(0, 1, MBR) == -1) {
+        io_error_exit("Read", 0, 1);
+    }
 #ifdef PARTITION_ENTRY_DEBUG
     print_sector(MBR);
 #endif
-    if (partition_num <= 4) {  // request the first four partition entries
-        read_mbr(MBR, &partition_entry, partition_num);
-    } else {  
-        int i;
-        PartitionEntry base_partition_entry;
-        // find which primary partition is extended.
-        // NOTICE: at most one partition can be extended
-        for (i = 1; i <= 4; ++i) {  
-            read_mbr(MBR, &base_partition_entry, i);
-            if (base_partition_entry.type == DOS_EXTENDED_PARTITION) {
-                break;
-            }
-        }
-        if (i > 4) {  // no extended partition in the first four entries
-            partition_entry.type = INVALID_TYPE;
-            return -1;
+    partition_table = 
+        (PartitionEntry*)malloc(capacity * sizeof(PartitionEntry));
+    partition_table_num = 0;
+    PartitionEntry entry;
+    for (i = 0; i < 4; ++i) {
+        read_partition_entry(MBR, 0, 
+                FIRST_PARTITION_OFFSET + PARTITION_ENTRY_SIZE * i, &entry);
+        add_partition(&entry, &capacity);
+    }
+    // NOTICE: at most one partition can be extended
+    for (i = 0; i < 4; ++i) {
+        if (partition_table[i].type == DOS_EXTENDED_PARTITION) {
+            entry = partition_table[i];
+            read_ebr_chain(&entry, &capacity);
+            break;
         }
-        PartitionEntry entry = read_ebr(&base_partition_entry, partition_num);
-        partition_entry.type = entry.type;
-        partition_entry.start = entry.start;
-        partition_entry.length = entry.length;
     }
+}
+
+/*
+ * read the specific partition's information
+ *  1) partition type
+ *  2) start sector
+ *  3) parition size
+ *  If the partition does not exist, set the partition entry's type 
+ *  to INVALID_TYPE and return -1
+ */
+int read_partition_info(int partition_num) {
+    if (partition_table == NULL) {
+        read_partition_table();
+    }
+    if (partition_num < 1 || partition_num > partition_table_num) {
+        partition_entry.type = INVALID_TYPE;
+        return -1;
+    }
+    partition_entry = partition_table[partition_num - 1];
     return 0;
 }
 
@@ -100,13 +154,11 @@ int read_partition_info(int partition_num) {
  *  If the partition does not exist, set the return partition
  *  entry's type to 0
  */
-void read_partition_entry(unsigned char* section, int start, 
+void read_partition_entry(unsigned char* section, __u64 start, 
         int offset, PartitionEntry* partition_entry) {
     partition_entry->type = section[offset + 4];
-    partition_entry->start = start + 
-        parse_bytes_to_decimal_u(section, offset + 8, offset + 12);
-    partition_entry->length = 
-        parse_bytes_to_decimal_u(section, offset + 12, offset + 16);
+    partition_entry->start = start + GET_LE32(section + offset + 8);
+    partition_entry->length = GET_LE32(section + offset + 12);
 }
 
 /*
@@ -119,7 +171,8 @@ int print_partition_info(int partition_num) {
         printf("-1\n");
         return -1;
     } 
-    printf("0x%02X %d %d\n", partition_entry.type, 
-            partition_entry.start, partition_entry.length);
+    printf("0x%02X %llu %llu\n", partition_entry.type, 
+            (unsigned long long)partition_entry.start, 
+            (unsigned long long)partition_entry.length);
     return 0;
 }
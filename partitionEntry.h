@@ -2,6 +2,6 @@
 #include "util.h"
 
 
-PartitionEntry read_ebr(PartitionEntry* base_partition_entry, int partition_num);
+void read_partition_table();
 int read_partition_info(int partition_num);
-void read_partition_entry(unsigned char* section, int start, int offset, PartitionEntry* partition_entry);
+void read_partition_entry(unsigned char* section, __u64 start, int offset, PartitionEntry* partition_entry);
@@ -0,0 +1,106 @@
+/*
+ * Copy one partition of the image into a file of its own 
+ * (-x <partition> -o <file>), found with the parsed partition table.
+ *
+ * A plain image is copied with copy_image_range: copy_file_range, 
+ * which shares the extents where the filesystem can (reflink), and 
+ * only the data extents, so the holes of a sparse image stay holes.
+ * A compressed image, or one seen through an overlay, is copied through
+ * read_sectors in EXPORT_CHUNK_SECTORS chunks, and chunks of zeros are
+ * left as holes.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include <unistd.h>
+#include "common.h"
+#include "util.h"
+
+// sectors copied at once, 4MB
+#define EXPORT_CHUNK_SECTORS 8192
+
+extern int read_partition_info(int partition_num);
+extern int copy_image_range(int in_fd, int64_t in_offset, int out_fd, 
+        int64_t out_offset, int64_t len);
+extern int pwrite_full(int fd, const char* buf, size_t len, off_t offset);
+
+/*
+ * Return 1 if the buffer only holds zeros
+ */
+static int all_zero(const char* buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if (buf[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Copy the partition through read_sectors, keeping zeros as holes
+ */
+static int copy_partition_by_chunks(int out) {
+    char* chunk = (char*)malloc(EXPORT_CHUNK_SECTORS * sector_size_bytes);
+    __u64 done, num;
+    int ret = 0;
+
+    for (done = 0; ret == 0 && done < partition_entry.length; done += num) {
+        num = partition_entry.length - done;
+        if (num > EXPORT_CHUNK_SECTORS) {
+            num = EXPORT_CHUNK_SECTORS;
+        }
+        ret = read_sectors(partition_entry.start + done, num, chunk);
+        if (ret == 0 && !all_zero(chunk, num * sector_size_bytes)) {
+            ret = pwrite_sectors(out, done, num, chunk);
+        }
+    }
+    free(chunk);
+    return ret;
+}
+
+/*
+ * Export the partition into path.
+ * Return 0, or -1 after printing why.
+ */
+int export_partition(int partition_num, const char* path) {
+    int64_t start, len;
+    int out, ret;
+
+    if (read_partition_info(partition_num) == -1 || 
+            IS_NULL_ENTRY(&partition_entry)) {
+        fprintf(stderr, "No partition %d\n", partition_num);
+        return -1;
+    }
+    start = (int64_t)partition_entry.start * sector_size_bytes;
+    len = (int64_t)partition_entry.length * sector_size_bytes;
+    if (start + len > get_image_size()) {
+        fprintf(stderr, "Partition %d goes past the end of the image\n", 
+                partition_num);
+        return -1;
+    }
+
+    out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        perror("Fail to create export file");
+        return -1;
+    }
+    if (ftruncate(out, len) == -1) {
+        perror("Fail to create export file");
+        close(out);
+        return -1;
+    }
+    if (compressed_image || use_overlay) {
+        ret = copy_partition_by_chunks(out);
+    } else {
+        ret = copy_image_range(device, start, out, 0, len);
+    }
+    if (ret == -1) {
+        perror("Fail to export partition");
+    }
+    if (close(out) == -1 && ret == 0) {
+        perror("Fail to export partition");
+        ret = -1;
+    }
+    return ret;
+}
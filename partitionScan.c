@@ -0,0 +1,142 @@
+/*
+ * Find ext2 partitions by their superblock when the partition table
+ * is damaged.
+ *
+ * The image is read sequentially in large chunks. A superblock sits 
+ * 1024 bytes into its partition and partitions start on a sector, so
+ * every sector is a candidate superblock: the 16 bits at offset 56 are
+ * compared with EXT2_SUPER_MAGIC, eight sectors per test. A candidate 
+ * is kept if its geometry is sane and it is a primary superblock 
+ * (group 0). The scan then jumps past the partition it found, so the 
+ * data of a filesystem is never taken for another one. The holes of a 
+ * sparse image are skipped without reading them.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+#include "util.h"
+
+extern void parse_super_block(unsigned char* contents, 
+        struct ext2_super_block* sb);
+extern int super_block_sane(struct ext2_super_block* sb);
+
+// sectors read at once, 4MB
+#define SCAN_CHUNK_SECTORS 8192
+#define MAGIC_OFFSET 56
+#define MAGIC_LO (EXT2_SUPER_MAGIC & 0xFF)
+#define MAGIC_HI (EXT2_SUPER_MAGIC >> 8)
+#define SECTOR_HAS_MAGIC(p) \
+    ((p)[MAGIC_OFFSET] == MAGIC_LO && (p)[MAGIC_OFFSET + 1] == MAGIC_HI)
+
+/*
+ * Check the candidate superblock in sector sb_sector.
+ * Return the partition's length in sectors, or 0 if it is not a 
+ * primary ext2 superblock.
+ */
+static __u64 check_candidate(__u64 sb_sector, __u64 image_sectors) {
+    unsigned char contents[SUPER_BLOCK_SIZE];
+    struct ext2_super_block sb;
+    // the partition starts 1024 bytes before its superblock
+    __u64 start = sb_sector - SUPER_BLOCK_SIZE / sector_size_bytes;
+
+    if (read_sectors(sb_sector, SUPER_BLOCK_SIZE / sector_size_bytes, 
+                contents) == -1) {
+        return 0;
+    }
+    parse_super_block(contents, &sb);
+    partition_entry.start = start;
+    partition_entry.length = image_sectors - start;
+    if (!super_block_sane(&sb) || sb.s_block_group_nr != 0) {
+        return 0;
+    }
+    return (__u64)sb.s_blocks_count * 
+        ((1024 << sb.s_log_block_size) / sector_size_bytes);
+}
+
+/*
+ * Scan the image and replace partition_table with the partitions 
+ * found, numbered from 1 in disk order.
+ * Return how many were found.
+ */
+int scan_partitions() {
+    __u64 image_sectors = get_image_size() / sector_size_bytes;
+    unsigned char* chunk = 
+        (unsigned char*)malloc(SCAN_CHUNK_SECTORS * sector_size_bytes);
+    int capacity = 16;
+    __u64 sector = SUPER_BLOCK_SIZE / sector_size_bytes;
+    __u32 i, j;
+
+    free(partition_table);
+    partition_table = 
+        (PartitionEntry*)malloc(capacity * sizeof(PartitionEntry));
+    partition_table_num = 0;
+
+    while (sector + SUPER_BLOCK_SIZE / sector_size_bytes <= image_sectors) {
+        __u32 num = SCAN_CHUNK_SECTORS;
+        if (sector + num > image_sectors) {
+            num = image_sectors - sector;
+        }
+        // a hole of a sparse image holds no superblock
+        if (!use_overlay && image_range_is_hole(
+                    (int64_t)sector * sector_size_bytes, 
+                    (size_t)num * sector_size_bytes)) {
+            sector += num;
+            continue;
+        }
+        if (read_sectors(sector, num, chunk) == -1) {
+            io_error_exit("Read", sector, num);
+        }
+
+        __u64 next = sector + num;
+        for (i = 0; i < num; i += 8) {
+            // test eight sectors at once, the common case is no match
+            unsigned char* p = chunk + i * sector_size_bytes;
+            __u32 n = num - i < 8? num - i: 8;
+            int any = 0;
+            for (j = 0; j < n; ++j) {
+                any |= SECTOR_HAS_MAGIC(p + j * sector_size_bytes);
+            }
+            if (!any) {
+                continue;
+            }
+            for (j = 0; j < n; ++j) {
+                if (!SECTOR_HAS_MAGIC(p + j * sector_size_bytes)) {
+                    continue;
+                }
+                __u64 sb_sector = sector + i + j;
+                __u64 length = check_candidate(sb_sector, image_sectors);
+                if (length == 0) {
+                    continue;
+                }
+                if (partition_table_num == capacity) {
+                    capacity *= 2;
+                    partition_table = (PartitionEntry*)realloc(
+                            partition_table, 
+                            capacity * sizeof(PartitionEntry));
+                }
+                PartitionEntry* entry = 
+                    &partition_table[partition_table_num++];
+                entry->type = EXT2_FS;
+                entry->start = sb_sector - 
+                    SUPER_BLOCK_SIZE / sector_size_bytes;
+                entry->length = length;
+                printf("Found ext2 partition %d at sector %llu, "
+                        "%llu sectors\n", partition_table_num, 
+                        (unsigned long long)entry->start, 
+                        (unsigned long long)entry->length);
+                // continue after the partition
+                next = entry->start + length + 
+                    SUPER_BLOCK_SIZE / sector_size_bytes;
+                break;
+            }
+            if (next != sector + num) {
+                break;
+            }
+        }
+        sector = next;
+    }
+    free(chunk);
+    partition_entry.type = INVALID_TYPE;
+    return partition_table_num;
+}
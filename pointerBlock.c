@@ -0,0 +1,117 @@
+/*
+ * Decode indirect pointer blocks.
+ *
+ * A pointer block holds block_size / 4 little endian block numbers.
+ * Every pointer is checked against [s_first_data_block, s_blocks_count)
+ * before anybody uses it as an index. Zero pointers are holes, other 
+ * pointers outside the range are invalid. Both are reported with a 
+ * bit mask (one bit per pointer), and the valid pointers are compacted
+ * into an array together with their position in the block.
+ *
+ * With SSE2 four pointers are checked at once. The kernel is compiled
+ * once per common block size, see select_decode_pointer_block().
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+
+#if defined(__SSE2__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <emmintrin.h>
+#define POINTER_BLOCK_SSE2
+#endif
+
+#define MASK_SET(mask, i) (mask)[(i) / 64] |= (__u64)1 << ((i) % 64)
+
+/*
+ * Return how many 64 bit words a mask of count pointers needs
+ */
+__u32 pointer_mask_words(__u32 count) {
+    return (count + 63) / 64;
+}
+
+/*
+ * Check count pointers starting at pointer number start. 
+ * Return the number of valid pointers appended to pb.
+ */
+static __u32 decode_pointers_scalar(unsigned char* block, __u32 start, 
+        __u32 count, __u32 first, __u32 end, PointerBlock* pb) {
+    __u32 i, pointer;
+    __u32 num = pb->num;
+    for (i = start; i < start + count; ++i) {
+        pointer = GET_LE32(block + i * 4);
+        if (pointer == 0) {
+            MASK_SET(pb->hole_mask, i);
+        } else if (pointer < first || pointer >= end) {
+            MASK_SET(pb->bad_mask, i);
+            ++pb->bad_num;
+        } else {
+            pb->pointers[num] = pointer;
+            pb->index[num++] = i;
+        }
+    }
+    return num - pb->num;
+}
+
+/*
+ * Decode one pointer block of count pointers into pb.
+ * pb's arrays must hold count entries, its masks 
+ * pointer_mask_words(count) words.
+ * Return the number of valid pointers.
+ */
+static ALWAYS_INLINE __u32 decode_pointer_block_sized(char* block, 
+        __u32 count, __u32 first, __u32 end, PointerBlock* pb) {
+    unsigned char* bytes = (unsigned char*)block;
+    __u32 words = pointer_mask_words(count);
+    __u32 i = 0;
+
+    pb->num = 0;
+    pb->bad_num = 0;
+    memset(pb->hole_mask, 0, words * sizeof(__u64));
+    memset(pb->bad_mask, 0, words * sizeof(__u64));
+
+#ifdef POINTER_BLOCK_SSE2
+    // SSE2 has no unsigned compare, flip the sign bits and compare signed
+    __m128i sign = _mm_set1_epi32(0x80000000);
+    __m128i first_v = _mm_xor_si128(_mm_set1_epi32(first), sign);
+    __m128i end_v = _mm_xor_si128(_mm_set1_epi32(end), sign);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128((__m128i*)(bytes + i * 4));
+        __m128i ps = _mm_xor_si128(p, sign);
+        __m128i hole = _mm_cmpeq_epi32(p, zero);
+        __m128i below = _mm_cmpgt_epi32(first_v, ps);
+        __m128i inside = _mm_cmpgt_epi32(end_v, ps);
+        __m128i bad = _mm_andnot_si128(hole, 
+                _mm_or_si128(below, _mm_andnot_si128(inside, 
+                        _mm_cmpeq_epi32(zero, zero))));
+        int hole_bits = _mm_movemask_ps(_mm_castsi128_ps(hole));
+        int bad_bits = _mm_movemask_ps(_mm_castsi128_ps(bad));
+        if ((hole_bits | bad_bits) == 0) {
+            // common case: four valid pointers, store them at once
+            _mm_storeu_si128((__m128i*)(pb->pointers + pb->num), p);
+            pb->index[pb->num] = i;
+            pb->index[pb->num + 1] = i + 1;
+            pb->index[pb->num + 2] = i + 2;
+            pb->index[pb->num + 3] = i + 3;
+            pb->num += 4;
+        } else if (hole_bits == 0xF) {
+            pb->hole_mask[i / 64] |= (__u64)0xF << (i % 64);
+        } else {
+            pb->num += decode_pointers_scalar(bytes, i, 4, first, end, pb);
+        }
+    }
+#endif
+    pb->num += decode_pointers_scalar(bytes, i, count - i, first, end, pb);
+    return pb->num;
+}
+
+#define decode_pointer_block_WRAPPER(suffix, size) \
+    static __u32 decode_pointer_block_##suffix(char* block, __u32 first, \
+            __u32 end, PointerBlock* pb) { \
+        return decode_pointer_block_sized(block, (size) / 4, \
+                first, end, pb); \
+    }
+
+DEFINE_BLOCK_KERNELS(DecodePointerBlockFunc, decode_pointer_block, 
+        select_decode_pointer_block)
@@ -0,0 +1,144 @@
+/*
+ * Read planner: collect the blocks a pass wants, then fetch them with 
+ * as few requests as possible. The wanted blocks are sorted, adjacent 
+ * ones are merged, and so are blocks separated by at most "gap" 
+ * unwanted blocks, which are read into a scratch buffer and dropped.
+ * Each request scatters the blocks straight into the callers' buffers
+ * with preadv.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include <sys/uio.h>
+#include "common.h"
+#include "util.h"
+#include "readPlan.h"
+
+#define READ_PLAN_MAX_IOV 64
+
+/*
+ * Start an empty plan. Runs of up to gap unwanted blocks between two 
+ * wanted ones are read through. The gap is capped at 
+ * READ_PLAN_MAX_BLOCKS, the longest request a plan makes.
+ */
+void read_plan_init(ReadPlan* plan, __u32 gap) {
+    plan->entries = NULL;
+    plan->num = 0;
+    plan->capacity = 0;
+    plan->gap = gap > READ_PLAN_MAX_BLOCKS? READ_PLAN_MAX_BLOCKS: gap;
+}
+
+/*
+ * Ask for one block to be read into "into" (block_size bytes)
+ */
+void read_plan_add(ReadPlan* plan, __u32 block, char* into) {
+    if (plan->num == plan->capacity) {
+        plan->capacity = plan->capacity == 0? 64: plan->capacity * 2;
+        plan->entries = (ReadPlanEntry*)realloc(plan->entries, 
+                plan->capacity * sizeof(ReadPlanEntry));
+    }
+    plan->entries[plan->num].block = block;
+    plan->entries[plan->num].into = into;
+    plan->num++;
+}
+
+/*
+ * Ask for block_num contiguous blocks to be read into one buffer
+ */
+void read_plan_add_range(ReadPlan* plan, __u32 block, __u32 block_num, 
+        char* into) {
+    __u32 i;
+    for (i = 0; i < block_num; ++i) {
+        read_plan_add(plan, block + i, into + i * block_size);
+    }
+}
+
+static int compare_entry(const void* a, const void* b) {
+    const ReadPlanEntry* x = (const ReadPlanEntry*)a;
+    const ReadPlanEntry* y = (const ReadPlanEntry*)b;
+    if (x->block != y->block) {
+        return x->block < y->block? -1: 1;
+    }
+    return 0;
+}
+
+/*
+ * Issue one request for blocks [first, first + block_num)
+ * The plans feed the check, so a failed request ends the program.
+ */
+static void read_request(__u32 first, struct iovec* iov, int iovcnt) {
+    __u32 sector_per_block = block_size / sector_size_bytes;
+    int64_t start = partition_entry.start + 
+        (int64_t)first * sector_per_block;
+    size_t len = 0;
+    int i;
+    if (read_sectors_vec(start, iov, iovcnt) == -1) {
+        for (i = 0; i < iovcnt; ++i) {
+            len += iov[i].iov_len;
+        }
+        io_error_exit("Read", start, len / sector_size_bytes);
+    }
+}
+
+/*
+ * Read every block of the plan, then empty it. 
+ * A block asked for twice is read once and copied.
+ */
+void read_plan_execute(ReadPlan* plan) {
+    ReadPlanEntry* entries = plan->entries;
+    struct iovec iov[READ_PLAN_MAX_IOV];
+    char* scratch = NULL;
+    __u32 i = 0, j, k, end, skip;
+    int iovcnt;
+
+    if (plan->num == 0) {
+        return;
+    }
+    if (plan->gap > 0) {
+        scratch = (char*)malloc((size_t)plan->gap * block_size);
+    }
+    qsort(entries, plan->num, sizeof(ReadPlanEntry), compare_entry);
+    while (i < plan->num) {
+        iov[0].iov_base = entries[i].into;
+        iov[0].iov_len = block_size;
+        iovcnt = 1;
+        end = entries[i].block + 1;
+        for (j = i + 1; j < plan->num; ++j) {
+            if (entries[j].block < end) {  // asked for twice
+                continue;
+            }
+            skip = entries[j].block - end;
+            if (skip > plan->gap || 
+                    entries[j].block + 1 - entries[i].block > 
+                    READ_PLAN_MAX_BLOCKS ||
+                    iovcnt + (skip > 0) + 1 > READ_PLAN_MAX_IOV) {
+                break;
+            }
+            if (skip > 0) {
+                iov[iovcnt].iov_base = scratch;
+                iov[iovcnt].iov_len = skip * block_size;
+                iovcnt++;
+            }
+            iov[iovcnt].iov_base = entries[j].into;
+            iov[iovcnt].iov_len = block_size;
+            iovcnt++;
+            end = entries[j].block + 1;
+        }
+        read_request(entries[i].block, iov, iovcnt);
+        for (k = i + 1; k < j; ++k) {
+            if (entries[k].block == entries[k - 1].block) {
+                memcpy(entries[k].into, entries[k - 1].into, block_size);
+            }
+        }
+        i = j;
+    }
+    free(scratch);
+    plan->num = 0;
+}
+
+void read_plan_free(ReadPlan* plan) {
+    free(plan->entries);
+    plan->entries = NULL;
+    plan->num = 0;
+    plan->capacity = 0;
+}
@@ -0,0 +1,6 @@
+void read_plan_init(ReadPlan* plan, __u32 gap);
+void read_plan_add(ReadPlan* plan, __u32 block, char* into);
+void read_plan_add_range(ReadPlan* plan, __u32 block, __u32 block_num, 
+        char* into);
+void read_plan_execute(ReadPlan* plan);
+void read_plan_free(ReadPlan* plan);
@@ -5,26 +5,98 @@
  * Code to read and write sectors to a "disk" file.
  * This is a support file for the "fsck" storage systems laboratory.
  *
+ * All I/O is positional (pread/pwrite, preadv/pwritev for several 
+ * buffers), so no file offset is shared and the p*_sectors functions
+ * take the descriptor to use. They retry on EINTR and short transfers
+ * and return -1 with errno set on failure; the callers decide whether
+ * the program can go on. read_sectors/write_sectors are thin wrappers 
+ * on the "device" global.
+ *
+ * With --direct (direct_io set), the image is opened with O_DIRECT and 
+ * read_sectors/write_sectors go through aligned buffers owned by this 
+ * file and a small direct mapped cache of DIRECT_CACHE_PAGES pages, so
+ * the check does not fill the page cache. The pages touched are 
+ * dropped from the page cache at exit.
+ *
+ * --max-iops and --max-mbps put token buckets in front of every request
+ * that reaches the device, see io_throttle().
+ *
+ * A zstd seekable image (compressed_image set) is read through 
+ * zstdImage.c and cannot be written.
+ *
+ * With --overlay (use_overlay set), writes go to the overlay file and 
+ * reads take the overlay pages on top of the image, see overlay.c.
+ *
+ * The data extents of a sparse image are mapped once with 
+ * SEEK_DATA/SEEK_HOLE (hole_map_init), and the parts of a read that
+ * fall in a hole are zero filled without asking the device.
+ *
  * author: Xiaoxiang Wu (xiaoxiaw)
  */
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE     /* for O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>     /* for memcpy() */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "zstdImage.h"
+#include "overlay.h"
 
-#if defined(__FreeBSD__)
-#define lseek64 lseek
-#endif
-
-/* linux: lseek64 declaration needed here to eliminate compiler warning. */
-extern int64_t lseek64(int, int64_t, int);
 extern int device;  
+extern char direct_io;
+extern char compressed_image;
+extern char use_overlay;
 
 #define sector_size_bytes 512
+#define MAX_IOV 64
+#define COPY_CHUNK (4 << 20)   /* bytes per copy request */
+
+#define DIRECT_ALIGN 4096      /* buffer, offset and length alignment */
+#define DIRECT_CACHE_PAGES 64  /* pages of the --direct cache */
+#define DIRECT_CACHE_SPAN 4    /* only requests up to this many pages are 
+                                  cached, bulk reads go around the cache */
+
+static char *direct_buffer;    /* aligned bounce buffer, grown on demand */
+static size_t direct_buffer_size;
+static char *direct_cache;     /* DIRECT_CACHE_PAGES aligned pages */
+static int64_t direct_cache_page[DIRECT_CACHE_PAGES];  /* -1 if empty */
+static off_t image_size;
+static off_t touched_start = -1;  /* byte range read or written */
+static off_t touched_end;
+
+static int64_t *extent_start;  /* data extents of the image, sorted */
+static int64_t *extent_end;
+static int extent_num = -1;    /* -1 if there is no map */
+static int extent_capacity;
+static int64_t mapped_size;
+
+/* Token bucket: tokens flow in at "rate" per second up to "burst".
+ * A request takes its tokens even when there are not enough, and then
+ * waits until the bucket is back to 0, so big requests are allowed but
+ * paid for.
+ */
+typedef struct TokenBucket {
+    double rate;    /* tokens per second, 0 for no limit */
+    double burst;
+    double tokens;
+} TokenBucket;
+
+static TokenBucket iops_bucket;   /* one token per request */
+static TokenBucket bytes_bucket;  /* one token per byte */
+static double bucket_time;        /* when the buckets were last filled */
+static double throttled_seconds;
+
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
 
 /* print_sector: print the contents of a buffer containing one sector.
  *
@@ -50,51 +122,880 @@ void print_sector (unsigned char *buf)
 }
 
 
-/* read_sectors: read a specified number of sectors into a buffer.
+/* Read up to len bytes at offset, retrying on EINTR and short reads.
+ * Returns the bytes read, less than len only at the end of the file, 
+ * or -1 with errno set.
+ */
+ssize_t pread_full (int fd, char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = pread(fd, buf + done, len - done, offset + done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+    return done;
+}
+
+/* Write len bytes at offset, retrying on EINTR and short writes.
+ * Returns 0, or -1 with errno set.
+ */
+int pwrite_full (int fd, const char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = pwrite(fd, buf + done, len - done, offset + done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/* Skip the first "done" bytes of an iovec array, in place.
+ * Returns the new start of the array, *iovcnt is updated.
+ */
+static struct iovec *advance_iov (struct iovec *iov, int *iovcnt, 
+        size_t done)
+{
+    while (*iovcnt > 0 && done >= iov->iov_len) {
+        done -= iov->iov_len;
+        ++iov;
+        --*iovcnt;
+    }
+    if (*iovcnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + done;
+        iov->iov_len -= done;
+    }
+    return iov;
+}
+
+/* Scatter / gather the bytes at offset into / from several buffers,
+ * retrying on EINTR and short transfers. At most MAX_IOV buffers.
+ * Returns 0, or -1 with errno set.
+ */
+static int preadv_full (int fd, const struct iovec *iov, int iovcnt, 
+        off_t offset)
+{
+    struct iovec local[MAX_IOV];
+    struct iovec *cur = local;
+    ssize_t ret;
+
+    if (iovcnt > MAX_IOV) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(local, iov, iovcnt * sizeof(struct iovec));
+    while (iovcnt > 0) {
+        ret = preadv(fd, cur, iovcnt, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+        offset += ret;
+        cur = advance_iov(cur, &iovcnt, ret);
+    }
+    return 0;
+}
+
+static int pwritev_full (int fd, const struct iovec *iov, int iovcnt, 
+        off_t offset)
+{
+    struct iovec local[MAX_IOV];
+    struct iovec *cur = local;
+    ssize_t ret;
+
+    if (iovcnt > MAX_IOV) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(local, iov, iovcnt * sizeof(struct iovec));
+    while (iovcnt > 0) {
+        ret = pwritev(fd, cur, iovcnt, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+        offset += ret;
+        cur = advance_iov(cur, &iovcnt, ret);
+    }
+    return 0;
+}
+
+static double now_seconds (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bucket_init (TokenBucket *bucket, double rate)
+{
+    bucket->rate = rate;
+    // a tenth of a second worth of requests can go at once
+    bucket->burst = rate / 10 > 1? rate / 10: 1;
+    bucket->tokens = bucket->burst;
+}
+
+/* Refill the bucket for "elapsed" seconds and take "need" tokens.
+ * Returns how long to wait before the request may go.
+ */
+static double bucket_take (TokenBucket *bucket, double elapsed, double need)
+{
+    if (bucket->rate <= 0)
+        return 0;
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->tokens -= need;
+    return bucket->tokens < 0? -bucket->tokens / bucket->rate: 0;
+}
+
+/* io_limit_set: cap the requests per second and the bytes per second
+ * of read_sectors/write_sectors. 0 means no cap.
+ */
+void io_limit_set (double iops, double bytes_per_second)
+{
+    bucket_init(&iops_bucket, iops);
+    bucket_init(&bytes_bucket, bytes_per_second);
+    bucket_time = now_seconds();
+}
+
+/* io_throttled_seconds: how long requests waited for the limiter.
+ */
+double io_throttled_seconds (void)
+{
+    return throttled_seconds;
+}
+
+/* io_set_idle_priority: put the process in the idle I/O scheduling 
+ * class, so it only gets the disk when nobody else wants it.
+ * Returns 0, or -1 with errno set.
+ */
+int io_set_idle_priority (void)
+{
+#ifdef SYS_ioprio_set
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, 
+            IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Wait until a request of len bytes fits in the limits.
+ */
+void io_throttle (size_t len)
+{
+    double now, wait, bytes_wait;
+    struct timespec ts;
+
+    if (iops_bucket.rate <= 0 && bytes_bucket.rate <= 0)
+        return;
+    now = now_seconds();
+    wait = bucket_take(&iops_bucket, now - bucket_time, 1);
+    bytes_wait = bucket_take(&bytes_bucket, now - bucket_time, len);
+    bucket_time = now;
+    if (bytes_wait > wait)
+        wait = bytes_wait;
+    if (wait <= 0)
+        return;
+    ts.tv_sec = (time_t)wait;
+    ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+    now = now_seconds();
+    throttled_seconds += now - bucket_time;
+    // the sleep refilled the buckets and paid the debt
+    bucket_take(&iops_bucket, now - bucket_time, 0);
+    bucket_take(&bytes_bucket, now - bucket_time, 0);
+    bucket_time = now;
+}
+
+/* direct_io_init: set up the buffers of --direct mode for the device
+ * global. Returns 0, or -1 with errno set.
+ */
+int direct_io_init (void)
+{
+    struct stat st;
+    int i;
+
+    if (fstat(device, &st) == -1)
+        return -1;
+    image_size = st.st_size;
+    if (posix_memalign((void **)&direct_cache, DIRECT_ALIGN, 
+                DIRECT_CACHE_PAGES * DIRECT_ALIGN) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < DIRECT_CACHE_PAGES; i++)
+        direct_cache_page[i] = -1;
+    return 0;
+}
+
+/* direct_io_close: drop the pages of the image touched by this run from
+ * the page cache, and free the --direct buffers.
+ */
+void direct_io_close (void)
+{
+    if (touched_start >= 0)
+        posix_fadvise(device, touched_start, touched_end - touched_start,
+                POSIX_FADV_DONTNEED);
+    free(direct_buffer);
+    free(direct_cache);
+    direct_buffer = NULL;
+    direct_buffer_size = 0;
+    direct_cache = NULL;
+}
+
+static void touch (off_t offset, size_t len)
+{
+    if (touched_start < 0 || offset < touched_start)
+        touched_start = offset;
+    if (offset + (off_t)len > touched_end)
+        touched_end = offset + len;
+}
+
+/* Return an aligned bounce buffer of at least size bytes.
+ */
+static char *get_direct_buffer (size_t size)
+{
+    if (size > direct_buffer_size) {
+        free(direct_buffer);
+        if (posix_memalign((void **)&direct_buffer, DIRECT_ALIGN, size) != 0) {
+            fprintf(stderr, "Cannot allocate %lu bytes for direct I/O\n",
+                    (unsigned long)size);
+            exit(-1);
+        }
+        direct_buffer_size = size;
+    }
+    return direct_buffer;
+}
+
+/* Load the bytes [offset, offset + len) of the image and return where 
+ * they are, inside the bounce buffer. The whole aligned span around them
+ * is read, from the cache if it holds every page of a small span.
+ * Returns NULL with errno set on failure.
+ */
+static char *direct_load (off_t offset, size_t len)
+{
+    off_t start = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+    off_t end = (offset + len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    int64_t first_page = start / DIRECT_ALIGN;
+    int64_t page_num = (end - start) / DIRECT_ALIGN;
+    char *buf = get_direct_buffer(end - start);
+    int64_t i;
+    int slot;
+    ssize_t ret;
+
+    if (page_num <= DIRECT_CACHE_SPAN) {
+        for (i = 0; i < page_num; i++) {
+            slot = (first_page + i) % DIRECT_CACHE_PAGES;
+            if (direct_cache_page[slot] != first_page + i)
+                break;
+        }
+        if (i == page_num) {
+            for (i = 0; i < page_num; i++) {
+                slot = (first_page + i) % DIRECT_CACHE_PAGES;
+                memcpy(buf + i * DIRECT_ALIGN, 
+                        direct_cache + slot * DIRECT_ALIGN, DIRECT_ALIGN);
+            }
+            return buf + (offset - start);
+        }
+    }
+
+    // the last page may be cut by the end of the image
+    io_throttle(end - start);
+    ret = pread_full(device, buf, end - start, start);
+    if (ret < 0)
+        return NULL;
+    if (ret < offset + (off_t)len - start) {
+        errno = EIO;
+        return NULL;
+    }
+    if (page_num <= DIRECT_CACHE_SPAN) {
+        for (i = 0; i < page_num; i++) {
+            slot = (first_page + i) % DIRECT_CACHE_PAGES;
+            memcpy(direct_cache + slot * DIRECT_ALIGN, 
+                    buf + i * DIRECT_ALIGN, DIRECT_ALIGN);
+            direct_cache_page[slot] = first_page + i;
+        }
+    }
+    return buf + (offset - start);
+}
+
+/* Write the bytes [offset, offset + len) with O_DIRECT. The pages at 
+ * both ends of the span are read first when the write does not cover 
+ * them. Cached pages are updated. Returns 0, or -1 with errno set.
+ */
+static int direct_store (off_t offset, size_t len, const char *from)
+{
+    off_t start = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+    off_t end = (offset + len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    int64_t first_page = start / DIRECT_ALIGN;
+    char *buf;
+    char *data;
+    int64_t i;
+    int slot;
+    int flags;
+    int ret;
+
+    if (end > image_size) {
+        // O_DIRECT cannot write a cut page without growing the image
+        flags = fcntl(device, F_GETFL);
+        fcntl(device, F_SETFL, flags & ~O_DIRECT);
+        io_throttle(len);
+        ret = pwrite_full(device, from, len, offset);
+        fcntl(device, F_SETFL, flags);
+        for (i = 0; i < DIRECT_CACHE_PAGES; i++)
+            if (direct_cache_page[i] >= first_page)
+                direct_cache_page[i] = -1;
+        return ret;
+    }
+
+    if (start == offset && end == offset + (off_t)len) {
+        buf = get_direct_buffer(end - start);
+    } else {
+        data = direct_load(start, end - start);
+        if (data == NULL)
+            return -1;
+        buf = data;
+    }
+    memcpy(buf + (offset - start), from, len);
+    io_throttle(end - start);
+    if (pwrite_full(device, buf, end - start, start) == -1)
+        return -1;
+    for (i = 0; i < (end - start) / DIRECT_ALIGN; i++) {
+        slot = (first_page + i) % DIRECT_CACHE_PAGES;
+        if (direct_cache_page[slot] == first_page + i)
+            memcpy(direct_cache + slot * DIRECT_ALIGN, 
+                    buf + i * DIRECT_ALIGN, DIRECT_ALIGN);
+    }
+    return 0;
+}
+
+/* get_image_size: size in bytes of the image behind the device global,
+ * decompressed if needed.
+ */
+int64_t get_image_size (void)
+{
+    struct stat st;
+
+    if (compressed_image)
+        return zstd_image_size();
+    if (fstat(device, &st) == -1)
+        return 0;
+    return st.st_size;
+}
+
+/* Append the data extent [start, end) to the map.
+ */
+static void add_extent (int64_t start, int64_t end)
+{
+    if (extent_num == extent_capacity) {
+        extent_capacity = extent_capacity == 0? 16: extent_capacity * 2;
+        extent_start = (int64_t *)realloc(extent_start, 
+                extent_capacity * sizeof(int64_t));
+        extent_end = (int64_t *)realloc(extent_end, 
+                extent_capacity * sizeof(int64_t));
+    }
+    extent_start[extent_num] = start;
+    extent_end[extent_num] = end;
+    extent_num++;
+}
+
+/* hole_map_init: map the data extents of the image behind the device
+ * global. Without a map (compressed image, or lseek cannot find 
+ * holes), every byte is taken as data. Returns 0, or -1 with errno set.
+ */
+int hole_map_init (void)
+{
+    int64_t data, hole = 0;
+
+    mapped_size = get_image_size();
+    extent_num = 0;
+    while (hole < mapped_size) {
+        data = lseek(device, hole, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            break;  // only a hole is left
+        if (data != -1)
+            hole = lseek(device, data, SEEK_HOLE);
+        if (data == -1 || hole == -1) {
+            extent_num = -1;
+            return -1;
+        }
+        add_extent(data, hole);
+    }
+    return 0;
+}
+
+/* Index of the first extent ending after offset, extent_num if none.
+ */
+static int find_extent (int64_t offset)
+{
+    int low = 0, high = extent_num, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (extent_end[mid] <= offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Record that [offset, offset + len) now holds data.
+ */
+static void mark_data (int64_t offset, size_t len)
+{
+    int64_t end = offset + len;
+    int i, j;
+
+    if (extent_num < 0)
+        return;
+    // extents touching the range are merged with it
+    i = find_extent(offset - 1);
+    for (j = i; j < extent_num && extent_start[j] <= end; j++) {
+        if (extent_start[j] < offset)
+            offset = extent_start[j];
+        if (extent_end[j] > end)
+            end = extent_end[j];
+    }
+    if (j == i) {
+        add_extent(0, 0);  // make room
+        memmove(extent_start + i + 1, extent_start + i, 
+                (extent_num - 1 - i) * sizeof(int64_t));
+        memmove(extent_end + i + 1, extent_end + i, 
+                (extent_num - 1 - i) * sizeof(int64_t));
+    } else if (j > i + 1) {
+        memmove(extent_start + i + 1, extent_start + j, 
+                (extent_num - j) * sizeof(int64_t));
+        memmove(extent_end + i + 1, extent_end + j, 
+                (extent_num - j) * sizeof(int64_t));
+        extent_num -= j - i - 1;
+    }
+    extent_start[i] = offset;
+    extent_end[i] = end;
+}
+
+/* image_range_is_hole: 1 if [offset, offset + len) holds no data.
+ */
+int image_range_is_hole (int64_t offset, size_t len)
+{
+    int i;
+
+    if (extent_num < 0 || offset + (int64_t)len > mapped_size)
+        return 0;
+    i = find_extent(offset);
+    return i == extent_num || extent_start[i] >= offset + (int64_t)len;
+}
+
+/* 1 if [offset, offset + len) is all data, so it can be read with one
+ * request.
+ */
+static int all_data (int64_t offset, size_t len)
+{
+    int i;
+
+    if (extent_num < 0 || offset + (int64_t)len > mapped_size)
+        return 1;
+    i = find_extent(offset);
+    return i < extent_num && extent_start[i] <= offset && 
+        extent_end[i] >= offset + (int64_t)len;
+}
+
+/* Read from the device, through the --direct buffers if they are used.
+ */
+static int read_device (off_t offset, size_t len, char *into)
+{
+    char *data;
+    ssize_t ret;
+
+    touch(offset, len);
+    if (direct_io) {
+        data = direct_load(offset, len);
+        if (data == NULL)
+            return -1;
+        memcpy(into, data, len);
+        return 0;
+    }
+    io_throttle(len);
+    ret = pread_full(device, into, len, offset);
+    if (ret >= 0 && (size_t)ret < len)
+        errno = EIO;
+    return ret >= 0 && (size_t)ret == len? 0: -1;
+}
+
+/* read_base_image: read len bytes at offset of the image itself, from
+ * wherever it lives, without the overlay.
+ * Returns 0, or -1 with errno set.
+ */
+int read_base_image (off_t offset, size_t len, char *into)
+{
+    size_t num;
+    int i;
+
+    if (compressed_image)
+        return zstd_image_read(into, len, offset);
+    if (all_data(offset, len))
+        return read_device(offset, len, into);
+    while (len > 0) {
+        i = find_extent(offset);
+        if (i == extent_num || extent_start[i] >= offset + (off_t)len) {
+            num = len;
+        } else if (extent_start[i] > offset) {
+            num = extent_start[i] - offset;
+        } else {
+            // data up to the end of the extent
+            num = extent_end[i] - offset < (off_t)len? 
+                (size_t)(extent_end[i] - offset): len;
+            if (read_device(offset, num, into) == -1)
+                return -1;
+            offset += num;
+            into += num;
+            len -= num;
+            continue;
+        }
+        memset(into, 0, num);
+        offset += num;
+        into += num;
+        len -= num;
+    }
+    return 0;
+}
+
+/* write_base_image: write len bytes at offset of the image itself.
+ * Returns 0, or -1 with errno set.
+ */
+int write_base_image (off_t offset, size_t len, const char *from)
+{
+    int ret;
+
+    if (compressed_image) {
+        errno = EROFS;
+        return -1;
+    }
+    touch(offset, len);
+    if (direct_io)
+        ret = direct_store(offset, len, from);
+    else {
+        io_throttle(len);
+        ret = pwrite_full(device, from, len, offset);
+    }
+    if (ret == 0)
+        mark_data(offset, len);
+    return ret;
+}
+
+static int image_read (off_t offset, size_t len, char *into)
+{
+    if (read_base_image(offset, len, into) == -1)
+        return -1;
+    return use_overlay? overlay_patch(offset, len, into): 0;
+}
+
+static int image_write (off_t offset, size_t len, const char *from)
+{
+    if (use_overlay)
+        return overlay_write(offset, len, from);
+    return write_base_image(offset, len, from);
+}
+
+/* Copy len bytes from in_fd to out_fd with copy_file_range, so the 
+ * kernel copies without going through user space, or shares the 
+ * extents (reflink) where the filesystem can. Falls back to reads and 
+ * writes where the files do not support it. Either way it copies 
+ * COPY_CHUNK bytes at a time, each through io_throttle().
+ * Returns 0, or -1 with errno set.
+ */
+static int copy_data_range (int in_fd, int64_t in_offset, int out_fd, 
+        int64_t out_offset, int64_t len)
+{
+    loff_t in_pos = in_offset;
+    loff_t out_pos = out_offset;
+    char *buf;
+    ssize_t ret;
+    size_t num;
+
+    while (len > 0) {
+        num = len < COPY_CHUNK? len: COPY_CHUNK;
+        io_throttle(num);
+        ret = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, num, 0);
+        if (ret > 0) {
+            len -= ret;
+            continue;
+        }
+        if (ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && 
+                errno != EOPNOTSUPP)
+            return -1;
+        break;
+    }
+
+    buf = (char *)malloc(COPY_CHUNK);
+    while (len > 0) {
+        num = len < COPY_CHUNK? len: COPY_CHUNK;
+        io_throttle(num);
+        ret = pread_full(in_fd, buf, num, in_pos);
+        if (ret >= 0 && (size_t)ret < num)
+            errno = EIO;
+        if ((size_t)ret != num || 
+                pwrite_full(out_fd, buf, num, out_pos) == -1) {
+            free(buf);
+            return -1;
+        }
+        in_pos += num;
+        out_pos += num;
+        len -= num;
+    }
+    free(buf);
+    return 0;
+}
+
+/* Copy the data extents of [in_offset, in_offset + len), see
+ * copy_image_range.
+ */
+static int copy_sparse_range (int in_fd, int64_t in_offset, int out_fd, 
+        int64_t out_offset, int64_t len)
+{
+    int64_t end = in_offset + len;
+    int64_t pos = in_offset;
+    int64_t data, hole;
+
+    while (pos < end) {
+        data = lseek(in_fd, pos, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            return 0;  // only a hole is left
+        if (data != -1)
+            hole = lseek(in_fd, data, SEEK_HOLE);
+        if (data == -1 || hole == -1) {
+            // cannot see holes, copy everything
+            return copy_data_range(in_fd, pos, out_fd, 
+                    out_offset + (pos - in_offset), end - pos);
+        }
+        if (data >= end)
+            return 0;
+        if (hole > end)
+            hole = end;
+        if (copy_data_range(in_fd, data, out_fd, 
+                    out_offset + (data - in_offset), hole - data) == -1)
+            return -1;
+        pos = hole;
+    }
+    return 0;
+}
+
+/* copy_image_range: copy len bytes from in_fd to out_fd, skipping the
+ * holes of in_fd. out_fd must already be long enough (ftruncate), the
+ * holes are left unwritten so they stay holes in a new file.
+ * The copy buffers are not aligned, so O_DIRECT is cleared on in_fd 
+ * for the copy, like direct_store does, and the pages it brought into
+ * the cache are dropped afterwards.
+ * Returns 0, or -1 with errno set.
+ */
+int copy_image_range (int in_fd, int64_t in_offset, int out_fd, 
+        int64_t out_offset, int64_t len)
+{
+    int flags = fcntl(in_fd, F_GETFL);
+    int direct = flags != -1 && (flags & O_DIRECT);
+    int saved_errno;
+    int ret;
+
+    if (direct)
+        fcntl(in_fd, F_SETFL, flags & ~O_DIRECT);
+    ret = copy_sparse_range(in_fd, in_offset, out_fd, out_offset, len);
+    if (direct) {
+        saved_errno = errno;
+        fcntl(in_fd, F_SETFL, flags);
+        posix_fadvise(in_fd, in_offset, len, POSIX_FADV_DONTNEED);
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+/* Read the image into several buffers: one preadv when the range is 
+ * plain data on the device, else buffer by buffer.
+ */
+static int image_readv (off_t offset, const struct iovec *iov, int iovcnt)
+{
+    off_t start = offset;
+    size_t len = 0;
+    char *data;
+    int i, ret;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (compressed_image || !all_data(offset, len)) {
+        ret = 0;
+        for (i = 0; ret == 0 && i < iovcnt; i++) {
+            ret = read_base_image(offset, iov[i].iov_len, 
+                    (char *)iov[i].iov_base);
+            offset += iov[i].iov_len;
+        }
+    } else if (direct_io) {
+        touch(offset, len);
+        data = direct_load(offset, len);
+        for (i = 0; data != NULL && i < iovcnt; i++) {
+            memcpy(iov[i].iov_base, data, iov[i].iov_len);
+            data += iov[i].iov_len;
+        }
+        ret = data == NULL? -1: 0;
+    } else {
+        touch(offset, len);
+        io_throttle(len);
+        ret = preadv_full(device, iov, iovcnt, offset);
+    }
+    offset = start;
+    for (i = 0; ret == 0 && use_overlay && i < iovcnt; i++) {
+        ret = overlay_patch(offset, iov[i].iov_len, (char *)iov[i].iov_base);
+        offset += iov[i].iov_len;
+    }
+    return ret;
+}
+
+/* pread_sectors: read sectors at a position, without moving the file
+ * offset.
  *
  * inputs:
+ *   int fd: the disk to read from. The image ("device") is read with 
+ *           its layers: --direct buffers, compressed image, holes and
+ *           overlay. Any other descriptor is read as it is.
  *   int64 start_sector: the starting sector number to read.
- *                       sector numbering starts with 0.
- *   int numsectors: the number of sectors to read.  must be >= 1.
- *   int device [GLOBAL]: the disk from which to read.
+ *   int numsectors: the number of sectors to read.
  *
  * outputs:
  *   void *into: the requested number of sectors are copied into here.
- *
- * modifies:
- *   void *into
+ *   returns 0, or -1 with errno set. Reading past the end of the disk
+ *   fails with EIO.
  */
-void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into)
+int pread_sectors (int fd, int64_t start_sector, unsigned int num_sectors, 
+        void *into)
 {
+    size_t len = (size_t)num_sectors * sector_size_bytes;
+    off_t offset = (off_t)start_sector * sector_size_bytes;
     ssize_t ret;
-    int64_t lret;
-    int64_t sector_offset;
-    ssize_t bytes_to_read;
 
-    /*
-    if (num_sectors == 1) {
-        printf("Reading sector %"PRId64"\n", start_sector);
-    } else {
-        printf("Reading sectors %"PRId64"--%"PRId64"\n",
-               start_sector, start_sector + (num_sectors - 1));
+    if (fd == device)
+        return image_read(offset, len, (char *)into);
+    ret = pread_full(fd, (char *)into, len, offset);
+    if (ret < 0)
+        return -1;
+    if ((size_t)ret < len) {
+        errno = EIO;
+        return -1;
     }
-    */
+    return 0;
+}
 
-    sector_offset = start_sector * sector_size_bytes;
+/* pwrite_sectors: write sectors at a position, see pread_sectors.
+ * Writes to the image go to the overlay when there is one.
+ */
+int pwrite_sectors (int fd, int64_t start_sector, unsigned int num_sectors, 
+        const void *from)
+{
+    size_t len = (size_t)num_sectors * sector_size_bytes;
+    off_t offset = (off_t)start_sector * sector_size_bytes;
 
-    if ((lret = lseek64(device, sector_offset, SEEK_SET)) != sector_offset) {
-        fprintf(stderr, "Seek to position %"PRId64" failed: "
-                "returned %"PRId64"\n", sector_offset, lret);
-        exit(-1);
-    }
+    if (fd == device)
+        return image_write(offset, len, (const char *)from);
+    return pwrite_full(fd, (const char *)from, len, offset);
+}
 
-    bytes_to_read = sector_size_bytes * num_sectors;
+/* preadv_sectors / pwritev_sectors: scatter/gather the sectors starting
+ * at start_sector into / from several buffers, with one request where
+ * the layers of the image allow it, see pread_sectors. Every buffer 
+ * must be a whole number of sectors. At most MAX_IOV buffers per call.
+ *
+ * returns 0, or -1 with errno set.
+ */
+int preadv_sectors (int fd, int64_t start_sector, const struct iovec *iov,
+        int iovcnt)
+{
+    off_t offset = (off_t)start_sector * sector_size_bytes;
 
-    if ((ret = read(device, into, bytes_to_read)) != bytes_to_read) {
-        fprintf(stderr, "Read sector %"PRId64" length %d failed: "
-                "returned %"PRId64"\n", start_sector, num_sectors, ret);
-        exit(-1);
+    if (fd == device)
+        return image_readv(offset, iov, iovcnt);
+    return preadv_full(fd, iov, iovcnt, offset);
+}
+
+int pwritev_sectors (int fd, int64_t start_sector, const struct iovec *iov,
+        int iovcnt)
+{
+    off_t offset = (off_t)start_sector * sector_size_bytes;
+    int i;
+
+    if (fd != device)
+        return pwritev_full(fd, iov, iovcnt, offset);
+    for (i = 0; i < iovcnt; i++) {
+        if (image_write(offset, iov[i].iov_len, 
+                    (const char *)iov[i].iov_base) == -1)
+            return -1;
+        offset += iov[i].iov_len;
     }
+    return 0;
+}
+
+/* read_sectors: read a specified number of sectors into a buffer.
+ *
+ * inputs:
+ *   int64 start_sector: the starting sector number to read.
+ *                       sector numbering starts with 0.
+ *   int numsectors: the number of sectors to read.  must be >= 1.
+ *   int device [GLOBAL]: the disk from which to read.
+ *
+ * outputs:
+ *   void *into: the requested number of sectors are copied into here.
+ *   returns 0, or -1 with errno set, see pread_sectors.
+ *
+ * modifies:
+ *   void *into
+ */
+int read_sectors (int64_t start_sector, unsigned int num_sectors, void *into)
+{
+    return pread_sectors(device, start_sector, num_sectors, into);
+}
+
+/* read_sectors_vec: read the sectors starting at start_sector into 
+ * several buffers, see preadv_sectors.
+ */
+int read_sectors_vec (int64_t start_sector, const struct iovec *iov, 
+        int iovcnt)
+{
+    return preadv_sectors(device, start_sector, iov, iovcnt);
 }
 
 
@@ -108,39 +1009,14 @@ void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into)
  *
  * outputs:
  *   int device [GLOBAL]: the disk into which to write.
+ *   returns 0, or -1 with errno set, see pwrite_sectors.
  *
  * modifies:
  *   int device [GLOBAL]
  */
-void write_sectors (int64_t start_sector, unsigned int num_sectors, void *from)
+int write_sectors (int64_t start_sector, unsigned int num_sectors, void *from)
 {
-    ssize_t ret;
-    int64_t lret;
-    int64_t sector_offset;
-    ssize_t bytes_to_write;
-
-    if (num_sectors == 1) {
-        printf("Reading sector  %"PRId64"\n", start_sector);
-    } else {
-        printf("Reading sectors %"PRId64"--%"PRId64"\n",
-               start_sector, start_sector + (num_sectors - 1));
-    }
-
-    sector_offset = start_sector * sector_size_bytes;
-
-    if ((lret = lseek64(device, sector_offset, SEEK_SET)) != sector_offset) {
-        fprintf(stderr, "Seek to position %"PRId64" failed: "
-                "returned %"PRId64"\n", sector_offset, lret);
-        exit(-1);
-    }
-
-    bytes_to_write = sector_size_bytes * num_sectors;
-
-    if ((ret = write(device, from, bytes_to_write)) != bytes_to_write) {
-        fprintf(stderr, "Write sector %"PRId64" length %d failed: "
-                "returned %"PRId64"\n", start_sector, num_sectors, ret);
-        exit(-1);
-    }
+    return pwrite_sectors(device, start_sector, num_sectors, from);
 }
 
 /*int main (int argc, char **argv)*/
@@ -0,0 +1,320 @@
+/*
+ * Buffered reporting of the problems found.
+ *
+ * The passes hand their findings to this layer instead of printing 
+ * them one by one. Findings are kept in memory for the partition being
+ * checked, contiguous block bitmap differences are merged into one 
+ * range, and everything is written out when the partition is done.
+ *
+ * Without a report file the findings are printed as text. With 
+ * --report FILE they go to the file, as JSON lines or, with 
+ * --report-format bin, as compact binary records, and only a one line 
+ * summary per partition is printed.
+ *
+ * Binary format: the magic "MFSR", a 32 bits version, then per finding
+ * kind (1 byte), partition (1 byte), name length (2 bytes), id, value,
+ * expected (4 bytes each) and the name. Numbers are little endian.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+#include "report.h"
+
+#define REPORT_VERSION 1
+#define REPORT_BUFFER_SIZE (1 << 20)
+
+typedef struct Finding {
+    unsigned char kind;
+    __u32 id;
+    __u32 value;
+    __u32 expected;
+    char* name;
+} Finding;
+
+/*
+ * Text and JSON keys of each kind. A NULL key is not written.
+ */
+typedef struct KindInfo {
+    const char* name;
+    const char* id_key;
+    const char* value_key;
+    const char* expected_key;
+} KindInfo;
+
+static const KindInfo kind_info[REPORT_KIND_NUM] = {
+    {"dir_entry", "parent", "inode", NULL},
+    {"dir_loop", "parent", "inode", NULL},
+    {"unreferenced", "inode", NULL, NULL},
+    {"links_count", "inode", "found", "expected"},
+    {"inode_unused", "inode", NULL, NULL},
+    {"inode_unmarked", "inode", NULL, NULL},
+    {"bad_pointers", "inode", "count", NULL},
+    {"dup_block", "block", "inode", NULL},
+    {"block_bitmap", "first", "last", NULL},
+    {"group_free_blocks", "group", "found", "expected"},
+    {"group_free_inodes", "group", "found", "expected"},
+    {"group_dirs", "group", "found", "expected"},
+    {"super_free_blocks", NULL, "found", "expected"},
+    {"super_free_inodes", NULL, "found", "expected"},
+    {"super_copy", "group", NULL, NULL}
+};
+
+static FILE* report_file = NULL;
+static int report_binary = 0;
+static int partition = 0;
+static Finding* findings = NULL;
+static __u32 finding_num = 0;
+static __u32 finding_capacity = 0;
+
+/*
+ * Open the report file. Return -1 if it cannot be created.
+ */
+int report_open(const char* path, int binary) {
+    report_file = fopen(path, binary? "wb": "w");
+    if (report_file == NULL) {
+        perror("Fail to open report file");
+        return -1;
+    }
+    setvbuf(report_file, NULL, _IOFBF, REPORT_BUFFER_SIZE);
+    report_binary = binary;
+    if (binary) {
+        __u32 version = REPORT_VERSION;
+        unsigned char header[8] = {'M', 'F', 'S', 'R', 
+            version & 0xFF, (version >> 8) & 0xFF, 
+            (version >> 16) & 0xFF, (version >> 24) & 0xFF};
+        fwrite(header, 1, sizeof(header), report_file);
+    }
+    return 0;
+}
+
+void report_close() {
+    if (report_file != NULL) {
+        fclose(report_file);
+        report_file = NULL;
+    }
+    free(findings);
+    findings = NULL;
+    finding_capacity = 0;
+}
+
+void report_begin_partition(int partition_num) {
+    partition = partition_num;
+    finding_num = 0;
+}
+
+static Finding* new_finding(ReportKind kind) {
+    if (finding_num == finding_capacity) {
+        finding_capacity = finding_capacity == 0? 256: finding_capacity * 2;
+        findings = (Finding*)realloc(findings, 
+                finding_capacity * sizeof(Finding));
+    }
+    Finding* finding = &findings[finding_num++];
+    finding->kind = kind;
+    finding->id = 0;
+    finding->value = 0;
+    finding->expected = 0;
+    finding->name = NULL;
+    return finding;
+}
+
+void report(ReportKind kind, __u32 id, __u32 value, __u32 expected) {
+    Finding* finding = new_finding(kind);
+    finding->id = id;
+    finding->value = value;
+    finding->expected = expected;
+}
+
+/*
+ * Report a finding about a directory entry, the name is copied
+ */
+void report_entry(ReportKind kind, __u32 parent, DirEntry* entry) {
+    Finding* finding = new_finding(kind);
+    finding->id = parent;
+    finding->value = entry->inode;
+    finding->name = (char*)malloc(entry->name_len + 1);
+    memcpy(finding->name, entry->name, entry->name_len);
+    finding->name[entry->name_len] = '\0';
+}
+
+/*
+ * Report one wrong bit of the block bitmap. It extends the previous 
+ * finding when that is the range ending right before the block.
+ */
+void report_block_bitmap_diff(__u32 block) {
+    if (finding_num > 0) {
+        Finding* last = &findings[finding_num - 1];
+        if (last->kind == REPORT_BLOCK_BITMAP && last->value + 1 == block) {
+            last->value = block;
+            return;
+        }
+    }
+    report(REPORT_BLOCK_BITMAP, block, block, 0);
+}
+
+static void print_finding(Finding* finding) {
+    switch (finding->kind) {
+        case REPORT_DIR_ENTRY:
+            printf("dir entry incorrect, parent inode_num: %u, "
+                    "subdir_name: %s, inode: %u\n", 
+                    finding->id, finding->name, finding->value);
+            break;
+        case REPORT_DIR_LOOP:
+            printf("directory loop, parent inode_num: %u, subdir_name: %s, "
+                    "inode: %u is already linked\n", 
+                    finding->id, finding->name, finding->value);
+            break;
+        case REPORT_UNREFERENCED:
+            printf("Unreferenced inodes: %u\n", finding->id);
+            break;
+        case REPORT_LINKS_COUNT:
+            printf("Inode %u ref count is %u, should be %u\n", 
+                    finding->id, finding->value, finding->expected);
+            break;
+        case REPORT_INODE_UNUSED:
+            printf("Inode %u is marked in use but unused\n", finding->id);
+            break;
+        case REPORT_INODE_UNMARKED:
+            printf("Inode %u is in use but not marked in the inode bitmap\n",
+                    finding->id);
+            break;
+        case REPORT_BAD_POINTERS:
+            printf("Inode %u has %u block pointers outside the filesystem\n",
+                    finding->id, finding->value);
+            break;
+        case REPORT_DUP_BLOCK:
+            if (finding->value == 0) {
+                printf("Block %u is multiply-claimed by filesystem "
+                        "metadata\n", finding->id);
+            } else {
+                printf("Block %u is multiply-claimed by inode %u\n", 
+                        finding->id, finding->value);
+            }
+            break;
+        case REPORT_BLOCK_BITMAP:
+            if (finding->id == finding->value) {
+                printf("Block bitmap difference: %u\n", finding->id);
+            } else {
+                printf("Block bitmap difference: %u-%u\n", 
+                        finding->id, finding->value);
+            }
+            break;
+        case REPORT_GROUP_FREE_BLOCKS:
+            printf("Group %u free blocks count is %u, should be %u\n", 
+                    finding->id, finding->value, finding->expected);
+            break;
+        case REPORT_GROUP_FREE_INODES:
+            printf("Group %u free inodes count is %u, should be %u\n", 
+                    finding->id, finding->value, finding->expected);
+            break;
+        case REPORT_GROUP_DIRS:
+            printf("Group %u directories count is %u, should be %u\n", 
+                    finding->id, finding->value, finding->expected);
+            break;
+        case REPORT_SUPER_FREE_BLOCKS:
+            printf("Superblock free blocks count is %u, should be %u\n", 
+                    finding->value, finding->expected);
+            break;
+        case REPORT_SUPER_FREE_INODES:
+            printf("Superblock free inodes count is %u, should be %u\n", 
+                    finding->value, finding->expected);
+            break;
+        case REPORT_SUPER_COPY:
+            printf("Superblock and group descriptor copy in group %u "
+                    "is out of date, rewritten\n", finding->id);
+            break;
+    }
+}
+
+/*
+ * Write a JSON string, escaping what JSON requires
+ */
+static void write_json_string(const char* s) {
+    fputc('"', report_file);
+    for (; *s != '\0'; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(report_file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(report_file, "\\u%04x", c);
+        } else {
+            fputc(c, report_file);
+        }
+    }
+    fputc('"', report_file);
+}
+
+static void write_json_finding(Finding* finding) {
+    const KindInfo* info = &kind_info[finding->kind];
+    fprintf(report_file, "{\"partition\":%d,\"kind\":\"%s\"", 
+            partition, info->name);
+    if (info->id_key != NULL) {
+        fprintf(report_file, ",\"%s\":%u", info->id_key, finding->id);
+    }
+    if (info->value_key != NULL) {
+        fprintf(report_file, ",\"%s\":%u", info->value_key, finding->value);
+    }
+    if (info->expected_key != NULL) {
+        fprintf(report_file, ",\"%s\":%u", info->expected_key, 
+                finding->expected);
+    }
+    if (finding->name != NULL) {
+        fputs(",\"name\":", report_file);
+        write_json_string(finding->name);
+    }
+    fputs("}\n", report_file);
+}
+
+static void put_le32(unsigned char* p, __u32 n) {
+    p[0] = n & 0xFF;
+    p[1] = (n >> 8) & 0xFF;
+    p[2] = (n >> 16) & 0xFF;
+    p[3] = (n >> 24) & 0xFF;
+}
+
+static void write_binary_finding(Finding* finding) {
+    unsigned char record[16];
+    __u32 name_len = finding->name == NULL? 0: strlen(finding->name);
+    record[0] = finding->kind;
+    record[1] = partition & 0xFF;
+    record[2] = name_len & 0xFF;
+    record[3] = (name_len >> 8) & 0xFF;
+    put_le32(record + 4, finding->id);
+    put_le32(record + 8, finding->value);
+    put_le32(record + 12, finding->expected);
+    fwrite(record, 1, sizeof(record), report_file);
+    if (name_len > 0) {
+        fwrite(finding->name, 1, name_len, report_file);
+    }
+}
+
+/*
+ * Write out the partition's findings
+ */
+void report_end_partition() {
+    __u32 counts[REPORT_KIND_NUM];
+    __u32 i;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < finding_num; ++i) {
+        Finding* finding = &findings[i];
+        ++counts[finding->kind];
+        if (report_file == NULL) {
+            print_finding(finding);
+        } else if (report_binary) {
+            write_binary_finding(finding);
+        } else {
+            write_json_finding(finding);
+        }
+        free(finding->name);
+    }
+    if (report_file != NULL) {
+        printf("Partition %d: %u problems", partition, finding_num);
+        for (i = 0; i < REPORT_KIND_NUM; ++i) {
+            if (counts[i] > 0) {
+                printf(", %s %u", kind_info[i].name, counts[i]);
+            }
+        }
+        printf("\n");
+    }
+    finding_num = 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Kinds of findings, see report.c for their text and JSON keys
+ */
+typedef enum ReportKind {
+    REPORT_DIR_ENTRY,          /* parent dir, entry inode, name */
+    REPORT_DIR_LOOP,           /* parent dir, entry inode, name */
+    REPORT_UNREFERENCED,       /* inode */
+    REPORT_LINKS_COUNT,        /* inode, on disk, counted */
+    REPORT_INODE_UNUSED,       /* inode */
+    REPORT_INODE_UNMARKED,     /* inode */
+    REPORT_BAD_POINTERS,       /* inode, pointers outside the filesystem */
+    REPORT_DUP_BLOCK,          /* block, claiming inode (0: metadata) */
+    REPORT_BLOCK_BITMAP,       /* first block, last block of the range */
+    REPORT_GROUP_FREE_BLOCKS,  /* group, on disk, counted */
+    REPORT_GROUP_FREE_INODES,  /* group, on disk, counted */
+    REPORT_GROUP_DIRS,         /* group, on disk, counted */
+    REPORT_SUPER_FREE_BLOCKS,  /* -, on disk, counted */
+    REPORT_SUPER_FREE_INODES,  /* -, on disk, counted */
+    REPORT_SUPER_COPY,         /* group whose superblock copy is rewritten */
+    REPORT_KIND_NUM
+} ReportKind;
+
+int report_open(const char* path, int binary);
+void report_close();
+void report_begin_partition(int partition_num);
+void report_end_partition();
+void report(ReportKind kind, __u32 id, __u32 value, __u32 expected);
+void report_entry(ReportKind kind, __u32 parent, DirEntry* entry);
+void report_block_bitmap_diff(__u32 block);
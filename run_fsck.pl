@@ -73,8 +73,11 @@ sub run_system_fsck {
 	print "Extracted partition name is: $p_data_file\n";
 	print "Partition start sector: $p_start.  Length: $p_length\n";
 	
-	# Extract partition and place it in $g_tmp_dir
-	my $cmd = "dd if=$g_image_file of=$p_data_file bs=512 ".
+	# Extract partition and place it in $g_tmp_dir, myfsck copies it
+	# with copy_file_range and keeps the holes
+	my $cmd = (-x "./myfsck") ?
+	    "./myfsck -i $g_image_file -x $_ -o $p_data_file" :
+	    "dd if=$g_image_file of=$p_data_file bs=512 ".
 	    "skip=$p_start count=$p_length";
 	if (system($cmd) != 0) {
 	    print "Could not extract partition $_";
@@ -0,0 +1,322 @@
+/*
+ * Validate the superblock and group descriptor table copies.
+ *
+ * Every group that holds a superblock (see group_has_super()) also 
+ * holds a copy of the GDT right after it. All copies are read, each 
+ * superblock with its GDT in one request, and compared by a 64 bits 
+ * FNV-1a hash. The superblock hash leaves out the fields the kernel 
+ * only updates in the primary (free counts, times, mount count, state,
+ * last mount point, orphan list) and the group number, the GDT hash 
+ * covers the bitmap and inode table locations only.
+ *
+ * The primary is used when it is sane. Otherwise the sane backup 
+ * written last wins, so a damaged primary superblock is recovered 
+ * without retrying backup locations by hand. The primary GDT is kept 
+ * whenever it is sane, since only it has up to date free counts. 
+ * Copies that disagree with the chosen ones are rewritten from them.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include "common.h"
+#include "util.h"
+#include "report.h"
+
+extern void parse_super_block(unsigned char* contents, 
+        struct ext2_super_block* sb);
+extern int group_has_super(__u32 group_id);
+extern __u32 get_block_group_num();
+extern __u32 get_group_desc_block_num();
+extern __u32 get_group_inode_block_num();
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// groups probed for a backup superblock when the primary is unusable
+static const __u32 probe_groups[] = {1, 3, 5, 7, 9, 25, 27, 49};
+
+// [start, end) byte ranges left out of the superblock hash
+static const __u32 volatile_fields[][2] = {
+    {12, 20},    /* s_free_blocks_count, s_free_inodes_count */
+    {44, 56},    /* s_mtime, s_wtime, s_mnt_count, s_max_mnt_count */
+    {58, 60},    /* s_state */
+    {64, 68},    /* s_lastcheck */
+    {90, 92},    /* s_block_group_nr */
+    {136, 200},  /* s_last_mounted */
+    {232, 236},  /* s_last_orphan */
+    {376, 384},  /* s_kbytes_written */
+    {1020, 1024} /* s_checksum */
+};
+
+/*
+ * One superblock copy and the GDT following it
+ */
+typedef struct SuperCopy {
+    __u32 group_id;
+    __u32 block;          /* first block of the copy */
+    __u32 super_offset;   /* offset of the superblock inside "data" */
+    char* data;           /* superblock block followed by the GDT */
+    struct ext2_super_block sb;
+    int sane;
+    int gdt_sane;
+    __u64 super_hash;
+    __u64 gdt_hash;
+} SuperCopy;
+
+static __u64 fnv1a(__u64 hash, unsigned char* bytes, __u32 len) {
+    __u32 i;
+    for (i = 0; i < len; ++i) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static __u64 hash_super_block(unsigned char* contents) {
+    unsigned char masked[SUPER_BLOCK_SIZE];
+    __u32 i;
+    memcpy(masked, contents, SUPER_BLOCK_SIZE);
+    for (i = 0; i < sizeof(volatile_fields) / sizeof(volatile_fields[0]);
+            ++i) {
+        memset(masked + volatile_fields[i][0], 0, 
+                volatile_fields[i][1] - volatile_fields[i][0]);
+    }
+    return fnv1a(FNV_OFFSET_BASIS, masked, SUPER_BLOCK_SIZE);
+}
+
+/*
+ * Hash the block bitmap, inode bitmap and inode table locations of
+ * every descriptor
+ */
+static __u64 hash_gdt(unsigned char* gdt, __u32 group_num) {
+    __u64 hash = FNV_OFFSET_BASIS;
+    __u32 i;
+    for (i = 0; i < group_num; ++i) {
+        hash = fnv1a(hash, gdt + i * GROUP_DESC_SIZE, 12);
+    }
+    return hash;
+}
+
+/*
+ * Return 1 if the superblock's geometry is self consistent and fits
+ * in the partition
+ */
+int super_block_sane(struct ext2_super_block* sb) {
+    if (sb->s_magic != EXT2_SUPER_MAGIC || sb->s_log_block_size > 2) {
+        return 0;
+    }
+    __u32 size = 1024U << sb->s_log_block_size;
+    if (sb->s_first_data_block != (size == 1024? 1: 0) ||
+            sb->s_blocks_per_group == 0 || 
+            sb->s_blocks_per_group > size * BITS_PER_BYTE ||
+            sb->s_inodes_per_group == 0 ||
+            sb->s_inodes_per_group > size * BITS_PER_BYTE ||
+            sb->s_blocks_count <= sb->s_first_data_block ||
+            (__u64)sb->s_blocks_count * (size / sector_size_bytes) > 
+            partition_entry.length) {
+        return 0;
+    }
+    __u32 group_num = (sb->s_blocks_count - sb->s_first_data_block + 
+            sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+    return sb->s_inodes_count == group_num * sb->s_inodes_per_group;
+}
+
+/*
+ * Return 1 if every descriptor of the GDT points inside the filesystem
+ */
+static int gdt_sane(unsigned char* gdt, __u32 group_num) {
+    __u32 first = super_block.s_first_data_block;
+    __u32 end = super_block.s_blocks_count;
+    __u32 table_num = get_group_inode_block_num();
+    __u32 i;
+    for (i = 0; i < group_num; ++i) {
+        unsigned char* desc = gdt + i * GROUP_DESC_SIZE;
+        __u32 block_bitmap = GET_LE32(desc);
+        __u32 inode_bitmap = GET_LE32(desc + 4);
+        __u32 inode_table = GET_LE32(desc + 8);
+        if (block_bitmap < first || block_bitmap >= end ||
+                inode_bitmap < first || inode_bitmap >= end ||
+                inode_table < first || inode_table + table_num > end) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Look for a sane backup superblock at the default locations of each
+ * block size, for when the primary cannot be trusted to say where the 
+ * backups are.
+ * Return 1 and fill sb if one is found.
+ */
+static int probe_backup_super_block(struct ext2_super_block* sb) {
+    unsigned char contents[SUPER_BLOCK_SIZE];
+    __u32 size, i;
+    for (size = 1024; size <= 4096; size *= 2) {
+        __u32 first = size == 1024? 1: 0;
+        for (i = 0; i < sizeof(probe_groups) / sizeof(probe_groups[0]); 
+                ++i) {
+            __u64 block = first + (__u64)probe_groups[i] * size * 
+                BITS_PER_BYTE;
+            __u64 sector = block * (size / sector_size_bytes);
+            if (sector + SUPER_BLOCK_SIZE / sector_size_bytes > 
+                    partition_entry.length) {
+                break;
+            }
+            // an unreadable candidate is not a backup
+            if (read_sectors(partition_entry.start + sector, 
+                        SUPER_BLOCK_SIZE / sector_size_bytes, 
+                        contents) == -1) {
+                continue;
+            }
+            parse_super_block(contents, sb);
+            if (super_block_sane(sb) && 
+                    1024U << sb->s_log_block_size == size &&
+                    sb->s_blocks_per_group == size * BITS_PER_BYTE) {
+                printf("Found backup superblock at block %llu\n", 
+                        (unsigned long long)block);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read one copy, the superblock and the GDT with one request
+ */
+static void read_super_copy(SuperCopy* copy, __u32 group_id, 
+        __u32 gdt_num, __u32 group_num) {
+    copy->group_id = group_id;
+    copy->block = super_block.s_first_data_block + 
+        group_id * super_block.s_blocks_per_group;
+    // the primary is 1024 bytes into the partition, whatever block size
+    copy->super_offset = (group_id == 0 && block_size > SUPER_BLOCK_SIZE)?
+        SUPER_BLOCK_SIZE: 0;
+    copy->data = (char*)malloc((1 + gdt_num) * block_size);
+    read_blocks(copy->block, 1 + gdt_num, copy->data);
+
+    unsigned char* contents = (unsigned char*)copy->data + copy->super_offset;
+    unsigned char* gdt = (unsigned char*)copy->data + block_size;
+    parse_super_block(contents, &copy->sb);
+    copy->gdt_sane = gdt_sane(gdt, group_num);
+    copy->sane = super_block_sane(&copy->sb) && 
+        copy->sb.s_blocks_count == super_block.s_blocks_count &&
+        copy->sb.s_blocks_per_group == super_block.s_blocks_per_group &&
+        copy->gdt_sane;
+    copy->super_hash = hash_super_block(contents);
+    copy->gdt_hash = hash_gdt(gdt, group_num);
+}
+
+/*
+ * Overwrite a copy with the chosen superblock and GDT, keeping its 
+ * group number, and write it back with one request
+ */
+static void refresh_super_copy(SuperCopy* copy, SuperCopy* chosen, 
+        SuperCopy* chosen_gdt, __u32 gdt_num) {
+    char* contents = copy->data + copy->super_offset;
+    if (copy != chosen) {
+        memcpy(contents, chosen->data + chosen->super_offset, 
+                SUPER_BLOCK_SIZE);
+        contents[90] = copy->group_id & 0xFF;
+        contents[91] = (copy->group_id >> 8) & 0xFF;
+    }
+    if (copy != chosen_gdt) {
+        memcpy(copy->data + block_size, chosen_gdt->data + block_size, 
+                gdt_num * block_size);
+    }
+    write_blocks(copy->block, 1 + gdt_num, copy->data);
+}
+
+/*
+ * A backup GDT carries the free counts of when it was written. Clear
+ * them, so no group is taken as empty and skipped before the counts 
+ * are checked.
+ */
+static void clear_gdt_free_counts(char* gdt, __u32 group_num) {
+    __u32 i;
+    for (i = 0; i < group_num; ++i) {
+        memset(gdt + i * GROUP_DESC_SIZE + 12, 0, 4);
+    }
+}
+
+/*
+ * Check all superblock and GDT copies of the partition, make 
+ * super_block the chosen one and bring the others in line with it.
+ * Must be called after read_super_block().
+ * Return -1 if no usable superblock is found.
+ */
+int check_super_backups() {
+    struct ext2_super_block backup;
+    if (!super_block_sane(&super_block)) {
+        printf("Primary superblock is damaged\n");
+        if (!probe_backup_super_block(&backup)) {
+            printf("No usable backup superblock found\n");
+            return -1;
+        }
+        super_block = backup;
+        block_size = get_block_size();
+    }
+
+    __u32 group_num = get_block_group_num();
+    __u32 gdt_num = get_group_desc_block_num();
+    __u32 copy_num = 0, i;
+    SuperCopy* copies = (SuperCopy*)calloc(group_num, sizeof(SuperCopy));
+    for (i = 0; i < group_num; ++i) {
+        if (group_has_super(i)) {
+            read_super_copy(&copies[copy_num++], i, gdt_num, group_num);
+        }
+    }
+
+    // the primary if it is sane, else the last written sane backup
+    SuperCopy* chosen = NULL;
+    for (i = 0; i < copy_num; ++i) {
+        if (!copies[i].sane) {
+            continue;
+        }
+        if (copies[i].group_id == 0) {
+            chosen = &copies[i];
+            break;
+        }
+        if (chosen == NULL || copies[i].sb.s_wtime > chosen->sb.s_wtime) {
+            chosen = &copies[i];
+        }
+    }
+    if (chosen == NULL) {
+        printf("No consistent superblock and group descriptor copy\n");
+        for (i = 0; i < copy_num; ++i) {
+            free(copies[i].data);
+        }
+        free(copies);
+        return -1;
+    }
+    if (chosen->group_id != 0) {
+        printf("Using the superblock copy of group %u\n", 
+                chosen->group_id);
+    }
+    super_block = chosen->sb;
+    block_size = get_block_size();
+
+    // keep the primary GDT unless it is damaged
+    SuperCopy* chosen_gdt = chosen;
+    if (chosen->group_id != 0 && copies[0].gdt_sane) {
+        chosen_gdt = &copies[0];
+    } else if (chosen->group_id != 0) {
+        clear_gdt_free_counts(chosen->data + block_size, group_num);
+    }
+
+    for (i = 0; i < copy_num; ++i) {
+        SuperCopy* copy = &copies[i];
+        if (!copy->sane || copy->super_hash != chosen->super_hash ||
+                copy->gdt_hash != chosen_gdt->gdt_hash ||
+                (copy->group_id == 0 && copy != chosen_gdt)) {
+            report(REPORT_SUPER_COPY, copy->group_id, 0, 0);
+            refresh_super_copy(copy, chosen, chosen_gdt, gdt_num);
+        }
+    }
+
+    for (i = 0; i < copy_num; ++i) {
+        free(copies[i].data);
+    }
+    free(copies);
+    return 0;
+}
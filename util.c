@@ -8,6 +8,7 @@
 /*
  * convert at most 4 bytes to unsigned decimal. (big endian)
  */
+#include <errno.h>
 #include "common.h"
 
 unsigned int parse_bytes_to_decimal_u(unsigned char* entry_info, 
@@ -33,21 +34,74 @@ int parse_bytes_to_decimal_s(unsigned char* entry_info,
     return result;
 }
 
+/*
+ * Report a failed sector request and end the program, for the callers
+ * that cannot go on without it. op is "Read" or "Write".
+ */
+void io_error_exit(const char* op, int64_t start_sector, 
+        unsigned int num_sectors) {
+    fprintf(stderr, "%s sector %lld length %u failed: %s\n", op, 
+            (long long)start_sector, num_sectors, strerror(errno));
+    exit(-1);
+}
+
 /*
  * Read the nth block from the partition
+ * Sector numbers are 64 bits: block numbers are 32 bits, but the 
+ * sector of a block past 2 TiB in a partition is not.
+ * The check cannot go on without its blocks, so the block functions 
+ * end the program when a request fails.
  */
 void read_block(__u32 block_offset, __u32 block_size, void *into) {
     int64_t start_sector = partition_entry.start;
     __u32 sector_per_block = block_size / sector_size_bytes;
-    __u32 sector_offset = block_offset * sector_per_block;
-    read_sectors(start_sector + sector_offset, sector_per_block, into);
+    int64_t sector_offset = (int64_t)block_offset * sector_per_block;
+    if (read_sectors(start_sector + sector_offset, 
+                sector_per_block, into) == -1) {
+        io_error_exit("Read", start_sector + sector_offset, 
+                sector_per_block);
+    }
+}
+
+/*
+ * Read block_num contiguous blocks starting at block_offset
+ * with one request.
+ */
+void read_blocks(__u32 block_offset, __u32 block_num, void *into) {
+    int64_t start_sector = partition_entry.start;
+    __u32 sector_per_block = block_size / sector_size_bytes;
+    int64_t sector_offset = (int64_t)block_offset * sector_per_block;
+    if (read_sectors(start_sector + sector_offset, 
+                sector_per_block * block_num, into) == -1) {
+        io_error_exit("Read", start_sector + sector_offset, 
+                sector_per_block * block_num);
+    }
+}
+
+/*
+ * Write block_num contiguous blocks starting at block_offset
+ * with one request.
+ */
+void write_blocks(__u32 block_offset, __u32 block_num, void *from) {
+    int64_t start_sector = partition_entry.start;
+    __u32 sector_per_block = block_size / sector_size_bytes;
+    int64_t sector_offset = (int64_t)block_offset * sector_per_block;
+    if (write_sectors(start_sector + sector_offset, 
+                sector_per_block * block_num, from) == -1) {
+        io_error_exit("Write", start_sector + sector_offset, 
+                sector_per_block * block_num);
+    }
 }
 
 void write_block(__u32 block_offset, __u32 block_size, char* from) {
     int64_t start_sector = partition_entry.start;
     __u32 sector_per_block = block_size / sector_size_bytes;
-    __u32 sector_offset = block_offset * sector_per_block;
-    write_sectors(start_sector + sector_offset, sector_per_block, from);
+    int64_t sector_offset = (int64_t)block_offset * sector_per_block;
+    if (write_sectors(start_sector + sector_offset, 
+                sector_per_block, from) == -1) {
+        io_error_exit("Write", start_sector + sector_offset, 
+                sector_per_block);
+    }
 }
 
 void print_block(char* contents) {
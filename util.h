@@ -1,6 +1,9 @@
 unsigned int parse_bytes_to_decimal_u(unsigned char* entry_info, int start, int len);
 int parse_bytes_to_decimal_s(unsigned char* entry_info, int start, int len);
+void io_error_exit(const char* op, int64_t start_sector, unsigned int num_sectors);
 void read_block(__u32 offset, __u32 block_size, void *into);
+void read_blocks(__u32 block_offset, __u32 block_num, void *into);
+void write_blocks(__u32 block_offset, __u32 block_num, void *from);
 void write_block(__u32 block_offset, __u32 block_size, char* from);
 void print_block(char* contents);
 __u32 get_block_size();
@@ -0,0 +1,278 @@
+/*
+ * Read-only access to disk images compressed in the zstd seekable 
+ * format: independent zstd frames followed by a seek table in a 
+ * skippable frame. The table gives the compressed and decompressed 
+ * size of every frame, so a read only decompresses the frames covering
+ * it. The last ZSTD_CACHE_FRAMES decompressed frames are kept.
+ *
+ * Built with HAVE_ZSTD (make ZSTD=1). Without it, compressed images are
+ * recognized and refused.
+ *
+ * Author: Xiaoxiang Wu
+ * Andrew ID: xiaoxiaw
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "zstdImage.h"
+
+#define ZSTD_FRAME_MAGIC 0xFD2FB528U
+#define SKIPPABLE_MAGIC 0x184D2A5EU
+#define SEEKABLE_MAGIC 0x8F92EAB1U
+#define SEEK_FOOTER_SIZE 9
+#define SKIPPABLE_HEADER_SIZE 8
+#define SEEK_CHECKSUM_FLAG 0x80
+#define ZSTD_CACHE_FRAMES 8
+
+#define GET_LE32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | \
+        (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+
+extern ssize_t pread_full (int fd, char *buf, size_t len, off_t offset);
+extern void io_throttle (size_t len);
+
+static uint32_t frame_num;
+static int64_t* compressed_offset;    /* frame_num + 1 entries */
+static int64_t* decompressed_offset;  /* frame_num + 1 entries */
+
+#ifdef HAVE_ZSTD
+static int image_fd = -1;
+
+typedef struct CachedFrame {
+    int64_t frame;  /* -1 if empty */
+    uint64_t used;  /* for LRU */
+    char* data;
+} CachedFrame;
+
+static CachedFrame frame_cache[ZSTD_CACHE_FRAMES];
+static uint64_t cache_clock;
+#endif
+
+/*
+ * Parse the seek table at the end of the file.
+ * Return 0, or -1 if the file is not in the seekable format.
+ */
+static int read_seek_table(int fd, off_t file_size) {
+    unsigned char footer[SEEK_FOOTER_SIZE];
+    unsigned char header[SKIPPABLE_HEADER_SIZE];
+    unsigned char* table;
+    uint32_t entry_size, i;
+    off_t table_size, table_start;
+
+    if (file_size < SEEK_FOOTER_SIZE + SKIPPABLE_HEADER_SIZE ||
+            pread_full(fd, (char*)footer, SEEK_FOOTER_SIZE, 
+                file_size - SEEK_FOOTER_SIZE) != SEEK_FOOTER_SIZE ||
+            GET_LE32(footer + 5) != SEEKABLE_MAGIC) {
+        return -1;
+    }
+    frame_num = GET_LE32(footer);
+    entry_size = (footer[4] & SEEK_CHECKSUM_FLAG)? 12: 8;
+    table_size = (off_t)frame_num * entry_size;
+    table_start = file_size - SEEK_FOOTER_SIZE - table_size;
+    if (table_start < SKIPPABLE_HEADER_SIZE ||
+            pread_full(fd, (char*)header, SKIPPABLE_HEADER_SIZE, 
+                table_start - SKIPPABLE_HEADER_SIZE) != 
+            SKIPPABLE_HEADER_SIZE ||
+            GET_LE32(header) != SKIPPABLE_MAGIC ||
+            GET_LE32(header + 4) != table_size + SEEK_FOOTER_SIZE) {
+        return -1;
+    }
+
+    table = (unsigned char*)malloc(table_size + 1);
+    if (pread_full(fd, (char*)table, table_size, table_start) != 
+            table_size) {
+        free(table);
+        return -1;
+    }
+    compressed_offset = (int64_t*)malloc((frame_num + 1) * sizeof(int64_t));
+    decompressed_offset = 
+        (int64_t*)malloc((frame_num + 1) * sizeof(int64_t));
+    compressed_offset[0] = 0;
+    decompressed_offset[0] = 0;
+    for (i = 0; i < frame_num; ++i) {
+        compressed_offset[i + 1] = 
+            compressed_offset[i] + GET_LE32(table + i * entry_size);
+        decompressed_offset[i + 1] = 
+            decompressed_offset[i] + GET_LE32(table + i * entry_size + 4);
+    }
+    free(table);
+    if (compressed_offset[frame_num] > 
+            table_start - SKIPPABLE_HEADER_SIZE) {
+        zstd_image_close();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Look at the image behind fd.
+ * Return 1 if it is a zstd seekable image, now used by zstd_image_read,
+ * 0 if it is not compressed, -1 if it cannot be used.
+ */
+int zstd_image_open(int fd) {
+    unsigned char magic[4];
+    struct stat st;
+
+    if (pread_full(fd, (char*)magic, 4, 0) != 4 || 
+            GET_LE32(magic) != ZSTD_FRAME_MAGIC) {
+        return 0;
+    }
+    if (fstat(fd, &st) == -1 || read_seek_table(fd, st.st_size) == -1) {
+        fprintf(stderr, "zstd image without a seek table, "
+                "compress it in the seekable format\n");
+        return -1;
+    }
+#ifndef HAVE_ZSTD
+    fprintf(stderr, "zstd image, but myfsck was built without zstd "
+            "(make ZSTD=1)\n");
+    zstd_image_close();
+    return -1;
+#else
+    int i;
+    for (i = 0; i < ZSTD_CACHE_FRAMES; ++i) {
+        frame_cache[i].frame = -1;
+        frame_cache[i].used = 0;
+        frame_cache[i].data = NULL;
+    }
+    image_fd = fd;
+    return 1;
+#endif
+}
+
+/*
+ * Size of the decompressed image in bytes
+ */
+int64_t zstd_image_size() {
+    return decompressed_offset == NULL? 0: decompressed_offset[frame_num];
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * Return the decompressed data of a frame, from the cache or 
+ * decompressed into the least recently used slot. NULL on failure.
+ */
+static char* load_frame(int64_t frame) {
+    int64_t compressed_size = 
+        compressed_offset[frame + 1] - compressed_offset[frame];
+    int64_t size = 
+        decompressed_offset[frame + 1] - decompressed_offset[frame];
+    CachedFrame* slot = &frame_cache[0];
+    char* compressed;
+    char* data;
+    size_t ret;
+    int i;
+
+    for (i = 0; i < ZSTD_CACHE_FRAMES; ++i) {
+        if (frame_cache[i].frame == frame) {
+            frame_cache[i].used = ++cache_clock;
+            return frame_cache[i].data;
+        }
+        if (frame_cache[i].used < slot->used) {
+            slot = &frame_cache[i];
+        }
+    }
+
+    compressed = (char*)malloc(compressed_size);
+    io_throttle(compressed_size);
+    if (pread_full(image_fd, compressed, compressed_size, 
+                compressed_offset[frame]) != compressed_size) {
+        free(compressed);
+        errno = EIO;
+        return NULL;
+    }
+    slot->frame = -1;
+    data = (char*)realloc(slot->data, size);
+    if (data == NULL) {
+        free(compressed);
+        errno = ENOMEM;
+        return NULL;
+    }
+    slot->data = data;
+    ret = ZSTD_decompress(slot->data, size, compressed, compressed_size);
+    free(compressed);
+    if (ZSTD_isError(ret) || ret != (size_t)size) {
+        fprintf(stderr, "zstd frame %"PRId64": %s\n", frame, 
+                ZSTD_isError(ret)? ZSTD_getErrorName(ret): "wrong size");
+        errno = EIO;
+        return NULL;
+    }
+    slot->frame = frame;
+    slot->used = ++cache_clock;
+    return slot->data;
+}
+#endif
+
+/*
+ * Read len bytes at offset of the decompressed image.
+ * Return 0, or -1 with errno set.
+ */
+int zstd_image_read(char* into, size_t len, int64_t offset) {
+#ifdef HAVE_ZSTD
+    uint32_t low = 0, high = frame_num, mid;
+    int64_t frame;
+    size_t num;
+    char* data;
+
+    if (offset < 0 || offset + (int64_t)len > zstd_image_size()) {
+        errno = EIO;
+        return -1;
+    }
+    // last frame starting at or before offset
+    while (high - low > 1) {
+        mid = (low + high) / 2;
+        if (decompressed_offset[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    for (frame = low; len > 0; ++frame) {
+        if (decompressed_offset[frame + 1] <= offset) {
+            continue;  // empty frame
+        }
+        data = load_frame(frame);
+        if (data == NULL) {
+            return -1;
+        }
+        num = decompressed_offset[frame + 1] - offset;
+        if (num > len) {
+            num = len;
+        }
+        memcpy(into, data + (offset - decompressed_offset[frame]), num);
+        into += num;
+        offset += num;
+        len -= num;
+    }
+    return 0;
+#else
+    (void)into;
+    (void)len;
+    (void)offset;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void zstd_image_close() {
+#ifdef HAVE_ZSTD
+    int i;
+    for (i = 0; i < ZSTD_CACHE_FRAMES; ++i) {
+        free(frame_cache[i].data);
+        frame_cache[i].data = NULL;
+        frame_cache[i].frame = -1;
+    }
+    image_fd = -1;
+#endif
+    free(compressed_offset);
+    free(decompressed_offset);
+    compressed_offset = NULL;
+    decompressed_offset = NULL;
+    frame_num = 0;
+}
@@ -0,0 +1,4 @@
+int zstd_image_open(int fd);
+int zstd_image_read(char* into, size_t len, int64_t offset);
+int64_t zstd_image_size();
+void zstd_image_close();